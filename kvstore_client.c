@@ -1,12 +1,18 @@
+#define _GNU_SOURCE
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #define SOCKET_PATH "/tmp/kvstore.sock"
+#define SEQ_SOCKET_PATH "/tmp/kvstore_seq.sock"
 #define BUF_SIZE 256
+#define BENCH_OPS 100000
+#define BENCH_BATCH 16
 
 // Error exit helper
 static void die(const char *msg)
@@ -15,27 +21,227 @@ static void die(const char *msg)
     exit(EXIT_FAILURE);
 }
 
-int main(void)
+// Connect to the server's stream or seqpacket socket
+static int connect_server(int seqpacket)
 {
-    int fd;
     struct sockaddr_un addr;
-    char buf[BUF_SIZE], cmd[BUF_SIZE];
+    const char *path = seqpacket ? SEQ_SOCKET_PATH : SOCKET_PATH;
 
-    // Create socket
-    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    int fd = socket(AF_UNIX, seqpacket ? SOCK_SEQPACKET : SOCK_STREAM, 0);
     if (fd == -1)
         die("socket");
 
     memset(&addr, 0, sizeof(addr));
     addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, SOCKET_PATH, sizeof(addr.sun_path) - 1);
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
 
-    // Connect to the server
     if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
         die("connect");
+    return fd;
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Build the i-th bench command: alternating SET and GET over 32 keys
+static int bench_cmd(char *out, long i)
+{
+    if (i % 2 == 0)
+        return snprintf(out, BUF_SIZE, "SET bench%ld %ld", (i / 2) % 32, i);
+    return snprintf(out, BUF_SIZE, "GET bench%ld", (i / 2) % 32);
+}
+
+// Stream mode: one write per batch, then count newline-terminated replies
+static void bench_stream(int fd, long ops, int batch, double *lat)
+{
+    char out[BENCH_BATCH * BUF_SIZE], in[BENCH_BATCH * BUF_SIZE];
+
+    for (long i = 0; i < ops; i += batch)
+    {
+        double t0 = now_sec();
+        size_t len = 0;
+        for (int j = 0; j < batch; j++)
+        {
+            len += bench_cmd(out + len, i + j);
+            out[len++] = '\n';
+        }
+        if (write(fd, out, len) != (ssize_t)len)
+            die("write");
+
+        int replies = 0;
+        while (replies < batch)
+        {
+            ssize_t n = read(fd, in, sizeof(in));
+            if (n <= 0)
+                die("read");
+            for (ssize_t k = 0; k < n; k++)
+                if (in[k] == '\n')
+                    replies++;
+        }
+        lat[i / batch] = now_sec() - t0;
+    }
+}
+
+// Seqpacket mode: one message per command, batched with sendmmsg/recvmmsg
+static void bench_seqpacket(int fd, long ops, int batch, double *lat)
+{
+    char out[BENCH_BATCH][BUF_SIZE], in[BENCH_BATCH][BUF_SIZE];
+    struct iovec oiov[BENCH_BATCH], iiov[BENCH_BATCH];
+    struct mmsghdr omsg[BENCH_BATCH], imsg[BENCH_BATCH];
+
+    memset(omsg, 0, sizeof(omsg));
+    memset(imsg, 0, sizeof(imsg));
+    for (int j = 0; j < BENCH_BATCH; j++)
+    {
+        oiov[j].iov_base = out[j];
+        omsg[j].msg_hdr.msg_iov = &oiov[j];
+        omsg[j].msg_hdr.msg_iovlen = 1;
+        iiov[j].iov_base = in[j];
+        iiov[j].iov_len = BUF_SIZE;
+        imsg[j].msg_hdr.msg_iov = &iiov[j];
+        imsg[j].msg_hdr.msg_iovlen = 1;
+    }
+
+    for (long i = 0; i < ops; i += batch)
+    {
+        double t0 = now_sec();
+        for (int j = 0; j < batch; j++)
+            oiov[j].iov_len = bench_cmd(out[j], i + j);
+
+        int sent = 0;
+        while (sent < batch)
+        {
+            int n = sendmmsg(fd, omsg + sent, batch - sent, 0);
+            if (n <= 0)
+                die("sendmmsg");
+            sent += n;
+        }
+
+        int replies = 0;
+        while (replies < batch)
+        {
+            int n = recvmmsg(fd, imsg, batch - replies, MSG_WAITFORONE, NULL);
+            if (n <= 0)
+                die("recvmmsg");
+            replies += n;
+        }
+        lat[i / batch] = now_sec() - t0;
+    }
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
 
-    printf("Connected to KV Store server at %s\n", SOCKET_PATH);
-    printf("Type commands (SET key value / GET key / EXIT)\n\n");
+// Time SET/GET round trips over both transports, unbatched and batched;
+// latencies are per round trip (one batch)
+static void run_bench(long ops)
+{
+    static const int batches[] = {1, BENCH_BATCH};
+
+    ops -= ops % BENCH_BATCH;
+    if (ops <= 0)
+        ops = BENCH_BATCH;
+    double *lat = malloc(ops * sizeof(double));
+    if (!lat)
+        die("malloc");
+
+    for (int seq = 0; seq <= 1; seq++)
+    {
+        for (int b = 0; b < 2; b++)
+        {
+            int fd = connect_server(seq);
+            double t0 = now_sec();
+            if (seq)
+                bench_seqpacket(fd, ops, batches[b], lat);
+            else
+                bench_stream(fd, ops, batches[b], lat);
+            double dt = now_sec() - t0;
+            close(fd);
+
+            long trips = ops / batches[b];
+            qsort(lat, trips, sizeof(double), cmp_double);
+            printf("%-9s batch=%-2d  %ld ops in %.3fs  %.0f ops/s  p50 %.1fus  p99 %.1fus\n",
+                   seq ? "seqpacket" : "stream", batches[b], ops, dt, ops / dt,
+                   lat[trips / 2] * 1e6, lat[trips * 99 / 100] * 1e6);
+        }
+    }
+    free(lat);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [--seqpacket] [--class=interactive|batch] [--bench[=OPS]]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option opts[] = {
+        {"seqpacket", no_argument, NULL, 's'},
+        {"bench", optional_argument, NULL, 'b'},
+        {"class", required_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0}};
+    int fd, seqpacket = 0, opt;
+    long bench = 0;
+    const char *qos = NULL;
+    char buf[BUF_SIZE], cmd[BUF_SIZE];
+
+    while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            seqpacket = 1;
+            break;
+        case 'b':
+            bench = optarg ? atol(optarg) : BENCH_OPS;
+            break;
+        case 'c':
+            qos = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (bench > 0)
+    {
+        run_bench(bench);
+        return 0;
+    }
+
+    // Connect to the server
+    fd = connect_server(seqpacket);
+
+    printf("Connected to KV Store server at %s\n", seqpacket ? SEQ_SOCKET_PATH : SOCKET_PATH);
+
+    // Declare the priority class before any command
+    if (qos)
+    {
+        int len = snprintf(cmd, sizeof(cmd), seqpacket ? "HELLO %s" : "HELLO %s\n", qos);
+        ssize_t n;
+        if (write(fd, cmd, len) == -1 || (n = read(fd, buf, sizeof(buf) - 1)) <= 0)
+        {
+            perror("HELLO");
+            close(fd);
+            return 1;
+        }
+        buf[n] = '\0';
+        if (strncmp(buf, "OK", 2) != 0)
+        {
+            fprintf(stderr, "unknown class: %s\n", qos);
+            close(fd);
+            return 1;
+        }
+    }
+    printf("Type commands (SET key value / GET key / MSET k v ... / MULTI ... EXEC / EXIT)\n\n");
 
     while (1)
     {
@@ -56,8 +262,12 @@ int main(void)
             break;
         }
 
-        // Send command to server
-        if (write(fd, cmd, strlen(cmd)) == -1)
+        // Send command to server: newline-terminated on a stream socket,
+        // one message per command on a seqpacket socket
+        size_t len = strlen(cmd);
+        if (!seqpacket)
+            cmd[len++] = '\n';
+        if (write(fd, cmd, len) == -1)
         {
             perror("write");
             break;
@@ -80,4 +290,3 @@ int main(void)
     close(fd);
     return 0;
 }
-
@@ -1,59 +1,732 @@
 #define _GNU_SOURCE
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <ucontext.h>
+#include <sched.h>
+#include <getopt.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#ifdef KV_LZ4
+#include <lz4.h>
+#endif
 
 #define SOCKET_PATH "/tmp/kvstore.sock"
+#define SEQ_SOCKET_PATH "/tmp/kvstore_seq.sock" // --seqpacket
 #define BACKLOG 10
 #define BUF_SIZE 256
 #define MAX_ENTRIES 100
+#define MAX_QUEUED 16   // commands per MULTI/EXEC batch
+#define REPLY_MAX (MAX_QUEUED * (BUF_SIZE + 1) + 1) // longest reply: an EXEC of MAX_QUEUED GETs
+#define SEQ_BATCH 16    // seqpacket messages taken per recvmmsg
+#define SHARED_INTS 10000 // 0..SHARED_INTS-1 are formatted once, at startup
+#define INT_STRLEN 21   // "-9223372036854775808" plus NUL
+#define IOBUF_SIZE 8192 // pooled connection buffer: input lines and payload starts, or replies
+#define IOBUF_POOL 1024 // idle buffers kept for reuse; more are freed
+#define CHUNK_SIZE 65536 // large values are stored and streamed in chunks this big
+#define MAX_LARGE (256 << 20) // largest SETL payload
+#define COMPRESS_MIN 1024 // default --compress-min (KV_LZ4 builds): smaller SETL values stay raw
+#define ZC_MIN (64 * 1024) // GETL replies this big use MSG_ZEROCOPY on TCP
+#define ZC_HOLDS 16     // zero-copy replies in flight per connection
+#define ZC_COPIED_MAX 8 // turn zero-copy off after this many sends the kernel copied anyway
+#define ZC_FULL_WAIT_MS 1000 // all holds in use: wait this long for a completion
+#define ZC_REAP_MS 50   // the reaper looks at connections closed with holds this often
+#define ZC_STUCK_MS 30000 // and resets one whose send queue has not moved for this long
+#define MAX_BUSY_POLL_US 1000000 // --busy-poll upper bound
+#define MAX_REACTORS 64 // --reactors upper bound
+#define CORO_STACK (64 * 1024) // per-connection coroutine stack (--reactors)
+#define CORO_POOL 1024  // finished coroutines kept per reactor with their stack pages
+#define CORO_SLAB 64    // stacks carved from one mapping
+#define CORO_CANARY 0x6b7673746b636f63ull // bottom word of every stack
+#define REACTOR_EVENTS 64 // epoll events taken per epoll_wait
+#define WHEEL_SLOTS 256 // reactor timer wheel: slots of WHEEL_TICK_MS
+#define WHEEL_TICK_MS 10
+#define OUTPUT_SOFT (64 * 1024) // default --output-limit: stop reading past this much unsent output,
+#define OUTPUT_HARD (1 << 20)   // drop a stalled client with this much,
+#define OUTPUT_SECS 10          // or one that takes nothing for this long
+#define CODEL_TARGET_MS 5       // admission: acceptable queue delay,
+#define CODEL_INTERVAL_MS 100   // exceeded for this long before shedding starts
+#define QOS_W_INTERACTIVE 8     // fair-queueing weights of the client classes
+#define QOS_W_BATCH 1
+#define QOS_SCALE 840           // virtual time per command at weight 1
+#define QOS_QUANTUM 64          // commands a coroutine runs before yielding its reactor
+#define IDLE_SECS 0             // default --idle-timeout: never
+#define KEEPALIVE_SECS 300      // default --keepalive: TCP keepalive probes after this idle time
+#define KEEPALIVE_PROBES 3      // unanswered probes, KEEPALIVE_SECS / this apart, before reset
+#define SLOWLOG_US 10000        // default --slowlog: log commands slower than this
+#define SLOWLOG_LEN 128         // slow log entries kept
+#define SLOWLOG_CMD 64          // command line bytes kept per entry, with NUL
+#define SLOWLOG_LINE 320        // room for the longest SLOWLOG GET line
 
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+/* A large value (SETL): a refcounted list of CHUNK_SIZE chunks, so readers can
+ * stream it to their socket without holding store_lock and without a copy. */
+typedef struct kv_blob {
+    int refs;           // store entry + readers in flight (atomic)
+    size_t len;
+    int nchunks;
+    struct kv_blob *dead_next; // blob_dead link
+    uint32_t *clen;     // per chunk: 0 = raw, else LZ4 bytes in chunks[i] (NULL: all raw)
+    char *chunks[];     // all full except the last
+} kv_blob;
+
+typedef enum { OBJ_STR, OBJ_INT, OBJ_BLOB } obj_enc;
+
+/* A key or value: canonical decimal integers are kept inline, large values are
+ * blobs, anything else is a heap string of exactly its length. Keys are never
+ * blobs. */
 typedef struct {
-    char key[BUF_SIZE];
-    char value[BUF_SIZE];
+    obj_enc enc;
+    union {
+        int64_t i;
+        char *s;
+        kv_blob *b;
+    } u;
+} kv_obj;
+
+typedef struct {
+    kv_obj key;
+    kv_obj value;
+    uint64_t version;   // changes on every write, never reused (0 = no such key)
 } keyvalue;
 
 static keyvalue store[MAX_ENTRIES];
 static int store_count = 0;
+static uint64_t store_version = 0; // last version handed out, under store_lock
 pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/* --------------------- Key-Value Store Functions --------------------- */
-const char *kv_get(const char *key) {
+/* counters for STATS (atomic) */
+static unsigned long zc_sends, zc_bytes, zc_copied;
+static unsigned long poll_hits, poll_sleeps;
+
+/* --------------------- Large Values --------------------- */
+/* Empty blob for len bytes; chunks are allocated as the data arrives. */
+static kv_blob *blob_new(size_t len) {
+    int nchunks = (len + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    kv_blob *b = calloc(1, sizeof(kv_blob) + nchunks * sizeof(char *));
+    if (!b) return NULL;
+    b->refs = 1;
+    b->len = len;
+    b->nchunks = nchunks;
+    return b;
+}
+
+static kv_blob *blob_ref(kv_blob *b) {
+    __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+    return b;
+}
+
+static void blob_free(kv_blob *b) {
+    for (int i = 0; i < b->nchunks; i++)
+        free(b->chunks[i]);
+    free(b->clen);
+    free(b);
+}
+
+static void blob_unref(kv_blob *b) {
+    if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0) blob_free(b);
+}
+
+/* Blobs whose last reference went while store_lock was held. Freeing up to
+ * MAX_LARGE bytes of chunks would keep every client waiting, so store_release()
+ * frees them after unlocking. Only touched under store_lock. */
+static kv_blob *blob_dead;
+
+static void blob_unref_locked(kv_blob *b) {
+    if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+    b->dead_next = blob_dead;
+    blob_dead = b;
+}
+
+static size_t chunk_len(const kv_blob *b, int i) {
+    return i < b->nchunks - 1 ? CHUNK_SIZE : b->len - (size_t)i * CHUNK_SIZE;
+}
+
+/* --------------------- Compression --------------------- */
+/* In KV_LZ4 builds, SETL values of at least --compress-min bytes (0: never) are
+ * LZ4-compressed chunk by chunk as the payload arrives, outside store_lock, and a
+ * chunk stays compressed only if that saves an eighth or more. GETL decompresses
+ * those chunks into a scratch buffer as it streams, so such replies are copied,
+ * never zero-copy. */
+static size_t compress_min = COMPRESS_MIN;
+
+#ifdef KV_LZ4
+static struct {
+    unsigned long packed, skipped, unpacked; // chunks compressed / not worth it / read back
+    uint64_t raw_bytes, packed_bytes;        // of the chunks that were kept compressed
+    uint64_t pack_ns, unpack_ns;
+} lz4_stats; // atomic
+
+static uint64_t now_ns(void);
+
+/* Compress chunk i of b (just filled) in place if that pays off. */
+static void blob_pack_chunk(kv_blob *b, int i) {
+    size_t len = chunk_len(b, i);
+    if (compress_min == 0 || b->len < compress_min) return;
+    if (!b->clen && !(b->clen = calloc(b->nchunks, sizeof(uint32_t)))) return;
+    char *dst = malloc(LZ4_COMPRESSBOUND(CHUNK_SIZE));
+    if (!dst) return;
+    uint64_t t0 = now_ns();
+    int n = LZ4_compress_default(b->chunks[i], dst, (int)len, LZ4_COMPRESSBOUND(CHUNK_SIZE));
+    __atomic_add_fetch(&lz4_stats.pack_ns, now_ns() - t0, __ATOMIC_RELAXED);
+    if (n <= 0 || (size_t)n > len - len / 8) {
+        __atomic_add_fetch(&lz4_stats.skipped, 1, __ATOMIC_RELAXED);
+        free(dst);
+        return;
+    }
+    __atomic_add_fetch(&lz4_stats.packed, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&lz4_stats.raw_bytes, len, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&lz4_stats.packed_bytes, n, __ATOMIC_RELAXED);
+    char *shrunk = realloc(dst, n);
+    free(b->chunks[i]);
+    b->chunks[i] = shrunk ? shrunk : dst;
+    b->clen[i] = n;
+}
+
+/* Chunk i of b, decompressed into scratch (CHUNK_SIZE bytes); NULL if corrupt. */
+static char *blob_unpack_chunk(const kv_blob *b, int i, char *scratch) {
+    int len = (int)chunk_len(b, i);
+    uint64_t t0 = now_ns();
+    int n = LZ4_decompress_safe(b->chunks[i], scratch, (int)b->clen[i], len);
+    __atomic_add_fetch(&lz4_stats.unpack_ns, now_ns() - t0, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&lz4_stats.unpacked, 1, __ATOMIC_RELAXED);
+    return n == len ? scratch : NULL;
+}
+
+/* STATS lines for compression into out (outlen bytes); returns their length. */
+static int compress_stats(char *out, size_t outlen) {
+    unsigned long packed = __atomic_load_n(&lz4_stats.packed, __ATOMIC_RELAXED);
+    unsigned long unpacked = __atomic_load_n(&lz4_stats.unpacked, __ATOMIC_RELAXED);
+    uint64_t raw = __atomic_load_n(&lz4_stats.raw_bytes, __ATOMIC_RELAXED);
+    uint64_t packed_bytes = __atomic_load_n(&lz4_stats.packed_bytes, __ATOMIC_RELAXED);
+    return snprintf(out, outlen, "compress_min %zu\ncompress_chunks_packed %lu\n"
+                    "compress_chunks_skipped %lu\ncompress_ratio %.2f\n"
+                    "compress_pack_ns %.0f\ncompress_unpack_ns %.0f\n",
+                    compress_min, packed, __atomic_load_n(&lz4_stats.skipped, __ATOMIC_RELAXED),
+                    packed_bytes ? (double)raw / packed_bytes : 1.0,
+                    packed ? (double)__atomic_load_n(&lz4_stats.pack_ns, __ATOMIC_RELAXED) / packed : 0.0,
+                    unpacked ? (double)__atomic_load_n(&lz4_stats.unpack_ns, __ATOMIC_RELAXED) / unpacked : 0.0);
+}
+#else
+static void blob_pack_chunk(kv_blob *b, int i) {
+    (void)b; (void)i;
+}
+static char *blob_unpack_chunk(const kv_blob *b, int i, char *scratch) {
+    (void)b; (void)i; (void)scratch;
+    return NULL; // no chunk is ever compressed
+}
+static int compress_stats(char *out, size_t outlen) {
+    (void)out; (void)outlen;
+    return 0;
+}
+#endif
+
+/* --------------------- Integer Encoding --------------------- */
+/* Text of the small ints, shared by every entry holding one: reads hand these out
+ * instead of formatting. */
+static char shared_ints[SHARED_INTS][5];
+static uint8_t shared_int_len[SHARED_INTS];
+
+static const char digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Parses s as an int64 only if printing the result gives back s exactly
+ * (no sign on zero, no leading zeros, no spaces, no overflow). */
+static int parse_int(const char *s, int64_t *out) {
+    const char *p = s;
+    int neg = (*p == '-');
+    if (neg) p++;
+    if (*p < '0' || *p > '9' || (*p == '0' && (p[1] != '\0' || neg)))
+        return 0;
+    uint64_t v = 0, lim = neg ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+    for (; *p; p++) {
+        if (*p < '0' || *p > '9') return 0;
+        unsigned d = *p - '0';
+        if (v > (lim - d) / 10) return 0;
+        v = v * 10 + d;
+    }
+    *out = neg ? (int64_t)(0 - v) : (int64_t)v;
+    return 1;
+}
+
+/* Writes v in decimal to out (INT_STRLEN bytes is always enough), two digits per
+ * step. Returns the length. */
+static size_t format_int(int64_t v, char *out) {
+    char tmp[INT_STRLEN];
+    char *p = tmp + sizeof(tmp);
+    uint64_t u = v < 0 ? 0 - (uint64_t)v : (uint64_t)v;
+    while (u >= 100) {
+        p -= 2;
+        memcpy(p, digit_pairs + (u % 100) * 2, 2);
+        u /= 100;
+    }
+    if (u >= 10) {
+        p -= 2;
+        memcpy(p, digit_pairs + u * 2, 2);
+    } else {
+        *--p = '0' + u;
+    }
+    if (v < 0) *--p = '-';
+    size_t len = tmp + sizeof(tmp) - p;
+    memcpy(out, p, len);
+    out[len] = '\0';
+    return len;
+}
+
+static void init_shared_ints(void) {
+    for (int i = 0; i < SHARED_INTS; i++)
+        shared_int_len[i] = format_int(i, shared_ints[i]);
+}
+
+/* Text of o: the heap string, a shared small int, or o formatted into buf
+ * (INT_STRLEN bytes). Sets *len if len is not NULL. */
+static const char *obj_str(const kv_obj *o, char *buf, size_t *len) {
+    if (o->enc == OBJ_STR) {
+        if (len) *len = strlen(o->u.s);
+        return o->u.s;
+    }
+    if (o->u.i >= 0 && o->u.i < SHARED_INTS) {
+        if (len) *len = shared_int_len[o->u.i];
+        return shared_ints[o->u.i];
+    }
+    size_t n = format_int(o->u.i, buf);
+    if (len) *len = n;
+    return buf;
+}
+
+/* Callers hold store_lock. */
+static void obj_release(kv_obj *o) {
+    if (o->enc == OBJ_STR) free(o->u.s);
+    else if (o->enc == OBJ_BLOB) blob_unref_locked(o->u.b);
+    o->enc = OBJ_INT;
+}
+
+/* Replace o with s (truncated to BUF_SIZE - 1 bytes, as before). Returns 0, or -1
+ * if out of memory (o unchanged). */
+static int obj_set(kv_obj *o, const char *s) {
+    int64_t i;
+    if (parse_int(s, &i)) {
+        obj_release(o);
+        o->enc = OBJ_INT;
+        o->u.i = i;
+        return 0;
+    }
+    size_t len = strnlen(s, BUF_SIZE - 1);
+    char *str = malloc(len + 1);
+    if (!str) return -1;
+    memcpy(str, s, len);
+    str[len] = '\0';
+    obj_release(o);
+    o->enc = OBJ_STR;
+    o->u.s = str;
+    return 0;
+}
+
+/* --------------------- Slow Log --------------------- */
+/* Commands that take longer than --slowlog=USEC (-1: off), from the moment the
+ * command (and any SETL payload) has been received until its reply is queued or
+ * streamed, go into a ring of the last SLOWLOG_LEN, with the time split into
+ * phases: queue (admission wait), parse (up to the first store_lock request),
+ * lock (waiting for store_lock), exec (the rest of running it) and write
+ * (queueing or streaming the reply; seqpacket replies go out in batches, so it
+ * is not timed there, nor is queueing a reply without sending it). Stamps come
+ * from the TSC where there is one, three per command unless something waited,
+ * and are converted to nanoseconds only for commands that get logged. Writers claim slots with one atomic add and
+ * publish them seqlock-style, so logging never takes a lock; SLOWLOG GET skips
+ * an entry that was overwritten while it was copied. */
+enum { SLOW_START, SLOW_ADMIT, SLOW_LOCK, SLOW_EXEC, SLOW_END, SLOW_STAMPS };
+enum { PH_QUEUE, PH_PARSE, PH_LOCK, PH_EXEC, PH_WRITE, PH_COUNT };
+
+typedef struct {
+    uint64_t t[SLOW_STAMPS]; // tsc() at each stamp, 0 if not reached
+    uint64_t lock_wait;      // cycles spent waiting for store_lock
+} slow_req;
+
+typedef struct {
+    uint64_t seq;            // id + 1 once written, 0 while being written
+    time_t when;
+    uint64_t total_ns, phase_ns[PH_COUNT];
+    char cmd[SLOWLOG_CMD];
+} slow_entry;
+
+static long slowlog_us = SLOWLOG_US; // -1: off
+static uint64_t slow_min;    // slowlog_us in TSC cycles
+static double tsc_ns = 1;    // nanoseconds per TSC cycle
+static slow_entry slow_ring[SLOWLOG_LEN];
+static uint64_t slow_next, slow_reset; // atomic: next id, first id not reset
+// the request being timed on this thread (coroutines save it across switches)
+static __thread slow_req *slow_cur;
+
+static inline uint64_t tsc(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+#endif
+}
+
+/* Measure the TSC rate against CLOCK_MONOTONIC; call once at startup. */
+static void slowlog_init(void) {
+    if (slowlog_us < 0) return; // off: nothing is timed
+    struct timespec a, b, pause = { 0, 20 * 1000000 };
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    uint64_t c0 = tsc();
+    nanosleep(&pause, NULL);
+    uint64_t c1 = tsc();
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    double ns = (b.tv_sec - a.tv_sec) * 1e9 + (b.tv_nsec - a.tv_nsec);
+    if (c1 > c0) tsc_ns = ns / (c1 - c0);
+    slow_min = (uint64_t)(slowlog_us * 1000 / tsc_ns);
+}
+
+/* A command has been received: start timing it on this thread. */
+static void slow_begin(slow_req *r) {
+    if (slowlog_us < 0) return; // --slowlog=-1: no timing at all
+    memset(r, 0, sizeof(*r));
+    r->t[SLOW_START] = tsc();
+    slow_cur = r;
+}
+
+static void slow_stamp(int stamp) {
+    if (slow_cur) slow_cur->t[stamp] = tsc();
+}
+
+/* Every store_lock acquisition goes through here, so its wait is timed (only
+ * read the clock twice when there is a wait). */
+static void store_acquire(void) {
+    slow_req *r = slow_cur;
+    if (pthread_mutex_trylock(&store_lock) == 0) {
+        if (r && !r->t[SLOW_LOCK]) r->t[SLOW_LOCK] = tsc();
+        return;
+    }
+    if (!r) {
+        pthread_mutex_lock(&store_lock);
+        return;
+    }
+    uint64_t t = tsc();
+    if (!r->t[SLOW_LOCK]) r->t[SLOW_LOCK] = t;
     pthread_mutex_lock(&store_lock);
+    r->lock_wait += tsc() - t;
+}
+
+/* Counterpart of store_acquire: unlock, then free the blobs that died meanwhile. */
+static void store_release(void) {
+    kv_blob *dead = blob_dead;
+    blob_dead = NULL;
+    pthread_mutex_unlock(&store_lock);
+    while (dead) {
+        kv_blob *next = dead->dead_next;
+        blob_free(dead);
+        dead = next;
+    }
+}
+
+/* The reply to cmd is out: log the command if it was slow. */
+static void slow_end(const char *cmd) {
+    slow_req *r = slow_cur;
+    if (!r) return;
+    slow_cur = NULL;
+    uint64_t *t = r->t;
+    t[SLOW_END] = tsc();
+    if (t[SLOW_END] - t[SLOW_START] < slow_min) return;
+    // stamps not reached: no admission (nothing to wait for), no store_lock
+    if (!t[SLOW_ADMIT]) t[SLOW_ADMIT] = t[SLOW_START];
+    if (!t[SLOW_EXEC]) t[SLOW_EXEC] = t[SLOW_END];
+    if (!t[SLOW_LOCK]) t[SLOW_LOCK] = t[SLOW_ADMIT];
+    uint64_t cycles[PH_COUNT] = {
+        t[SLOW_ADMIT] - t[SLOW_START], t[SLOW_LOCK] - t[SLOW_ADMIT], r->lock_wait,
+        t[SLOW_EXEC] - t[SLOW_LOCK] - r->lock_wait, t[SLOW_END] - t[SLOW_EXEC]
+    };
+
+    uint64_t id = __atomic_fetch_add(&slow_next, 1, __ATOMIC_RELAXED);
+    slow_entry *e = &slow_ring[id % SLOWLOG_LEN];
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->when = time(NULL);
+    e->total_ns = (uint64_t)((t[SLOW_END] - t[SLOW_START]) * tsc_ns);
+    for (int i = 0; i < PH_COUNT; i++) e->phase_ns[i] = (uint64_t)(cycles[i] * tsc_ns);
+    snprintf(e->cmd, sizeof(e->cmd), "%s", cmd);
+    __atomic_store_n(&e->seq, id + 1, __ATOMIC_RELEASE);
+}
+
+/* Entries currently in the log. */
+static uint64_t slowlog_len(void) {
+    uint64_t next = __atomic_load_n(&slow_next, __ATOMIC_ACQUIRE);
+    uint64_t n = next - __atomic_load_n(&slow_reset, __ATOMIC_RELAXED);
+    return n < SLOWLOG_LEN ? n : SLOWLOG_LEN;
+}
+
+static void slowlog_reset(void) {
+    __atomic_store_n(&slow_reset, __atomic_load_n(&slow_next, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+}
+
+/* SLOWLOG GET [count]: the newest entries first, as many as fit in size, each
+ * "id unixtime total_us phase us ... command", then "END". */
+static size_t slowlog_get(long count, char *out, size_t size) {
+    uint64_t next = __atomic_load_n(&slow_next, __ATOMIC_ACQUIRE);
+    uint64_t n = slowlog_len();
+    size_t len = 0;
+    for (uint64_t id = next; n > 0 && count > 0 && size - len >= SLOWLOG_LINE + 4; n--) {
+        slow_entry *e = &slow_ring[--id % SLOWLOG_LEN], copy;
+        uint64_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        if (seq != id + 1) continue; // being written, or already reused
+        memcpy(&copy, e, sizeof(copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq) continue;
+        copy.cmd[SLOWLOG_CMD - 1] = '\0';
+        len += snprintf(out + len, SLOWLOG_LINE,
+                        "%" PRIu64 " %ld %.1f queue %.1f parse %.1f lock %.1f exec %.1f write %.1f %s\n",
+                        id, (long)copy.when, copy.total_ns / 1e3, copy.phase_ns[PH_QUEUE] / 1e3,
+                        copy.phase_ns[PH_PARSE] / 1e3, copy.phase_ns[PH_LOCK] / 1e3,
+                        copy.phase_ns[PH_EXEC] / 1e3, copy.phase_ns[PH_WRITE] / 1e3, copy.cmd);
+        count--;
+    }
+    memcpy(out + len, "END\n", 4);
+    return len + 4;
+}
+
+/* --------------------- Key-Value Store Functions --------------------- */
+/* The *_locked variants expect the caller to hold store_lock. */
+static keyvalue *kv_find_locked(const char *key) {
+    int64_t ikey;
+    int is_int = parse_int(key, &ikey); // once, not per entry
     for (int i = 0; i < store_count; i++) {
-        if (strcmp(store[i].key, key) == 0) {
-            pthread_mutex_unlock(&store_lock);
-            return store[i].value;
-        }
+        const kv_obj *k = &store[i].key;
+        if (is_int ? (k->enc == OBJ_INT && k->u.i == ikey)
+                   : (k->enc == OBJ_STR && strcmp(k->u.s, key) == 0))
+            return &store[i];
     }
-    pthread_mutex_unlock(&store_lock);
     return NULL;
 }
 
+/* Entry for key, created (with an int 0 value) if absent; NULL if the store is
+ * full or out of memory. */
+static keyvalue *kv_entry_locked(const char *key) {
+    keyvalue *kv = kv_find_locked(key);
+    if (kv) return kv;
+    if (store_count == MAX_ENTRIES) return NULL;
+    kv = &store[store_count];
+    kv->key.enc = kv->value.enc = OBJ_INT; // nothing to free yet
+    kv->value.u.i = 0;
+    if (obj_set(&kv->key, key) < 0) return NULL;
+    store_count++;
+    return kv;
+}
+
+/* Returns the new version of key, or 0 if the store is full (or out of memory). */
+static uint64_t kv_set_locked(const char *key, const char *value) {
+    keyvalue *kv = kv_entry_locked(key);
+    if (!kv || obj_set(&kv->value, value) < 0) return 0;
+    return kv->version = ++store_version;
+}
+
+/* Store blob b (taking over the caller's reference) as the value of key. A
+ * replaced blob is freed after unlocking, or once the last reader streaming it
+ * drops its reference. */
+static uint64_t kv_set_blob(const char *key, kv_blob *b) {
+    uint64_t version = 0;
+    store_acquire();
+    keyvalue *kv = kv_entry_locked(key);
+    if (kv) {
+        obj_release(&kv->value);
+        kv->value.enc = OBJ_BLOB;
+        kv->value.u.b = b;
+        version = kv->version = ++store_version;
+    }
+    store_release();
+    if (!version) blob_unref(b);
+    return version;
+}
+
+/* Compare-and-swap: write only if key is still at expected version (0 = absent).
+ * Returns 1 and the new version on success, 0 and the current version on conflict,
+ * -1 if the store is full. */
+static int kv_cas_locked(const char *key, uint64_t expected, const char *value,
+                         uint64_t *version) {
+    keyvalue *kv = kv_find_locked(key);
+    uint64_t cur = kv ? kv->version : 0;
+    if (cur != expected) {
+        *version = cur;
+        return 0;
+    }
+    *version = kv_set_locked(key, value);
+    return *version ? 1 : -1;
+}
+
+/* Copies the value of key into out (BUF_SIZE bytes). Returns the entry version,
+ * or 0 if the key does not exist. A large value is not copied: *blob gets a
+ * reference to it instead (the caller drops it with blob_unref), else NULL. */
+uint64_t kv_get(const char *key, char *out, kv_blob **blob) {
+    uint64_t version = 0;
+    *blob = NULL;
+    store_acquire();
+    keyvalue *kv = kv_find_locked(key);
+    if (kv && kv->value.enc == OBJ_BLOB) {
+        *blob = blob_ref(kv->value.u.b);
+        version = kv->version;
+    } else if (kv) {
+        size_t len;
+        const char *v = obj_str(&kv->value, out, &len);
+        if (v != out) memcpy(out, v, len + 1);
+        version = kv->version;
+    }
+    store_release();
+    return version;
+}
+
 void kv_set(const char *key, const char *value) {
-    pthread_mutex_lock(&store_lock);
-    for (int i = 0; i < store_count; i++) {
-        if (strcmp(store[i].key, key) == 0) {
-            strncpy(store[i].value, value, BUF_SIZE - 1);
-            store[i].value[BUF_SIZE - 1] = '\0';
-            pthread_mutex_unlock(&store_lock);
-            return;
+    store_acquire();
+    kv_set_locked(key, value);
+    store_release();
+}
+
+int kv_cas(const char *key, uint64_t expected, const char *value, uint64_t *version) {
+    store_acquire();
+    int rc = kv_cas_locked(key, expected, value, version);
+    store_release();
+    return rc;
+}
+
+/* Reply line for a CAS result. */
+static int format_cas(char *out, size_t outlen, int rc, uint64_t version) {
+    if (rc > 0)
+        return snprintf(out, outlen, "OK %" PRIu64 "\n", version);
+    if (rc == 0)
+        return snprintf(out, outlen, "CONFLICT %" PRIu64 "\n", version);
+    return snprintf(out, outlen, "ERROR\n");
+}
+
+/* --------------------- One-shot Batches (MULTI/EXEC, MSET) --------------------- */
+/* Batches are queued per connection and applied under a single store_lock hold,
+ * so the lock is never kept across a network round trip. */
+typedef enum { CMD_SET, CMD_GET, CMD_CAS } cmd_op;
+
+typedef struct {
+    cmd_op op;
+    char key[BUF_SIZE];
+    char value[BUF_SIZE];
+    uint64_t version;   // CAS only
+} queued_cmd;
+
+/* Parse a SET/GET/CAS line into a queued command. Returns 0 on success. */
+static int parse_queued(const char *buf, queued_cmd *q) {
+    if (strncmp(buf, "SETL ", 5) == 0 || strncmp(buf, "GETL ", 5) == 0)
+        return -1; // streamed commands cannot be batched
+    if (sscanf(buf, "CAS %255s %" SCNu64 " %255[^\n]", q->key, &q->version, q->value) == 3) {
+        q->op = CMD_CAS;
+        return 0;
+    }
+    if (sscanf(buf, "SET %255s %255[^\n]", q->key, q->value) == 2) {
+        q->op = CMD_SET;
+        return 0;
+    }
+    if (sscanf(buf, "GET %255s", q->key) == 1) {
+        q->op = CMD_GET;
+        return 0;
+    }
+    return -1;
+}
+
+/* Whether q[0..n) can create all the entries it may need: SETs of absent keys and
+ * CASes expecting absence, each key counted once. */
+static int kv_room_locked(const queued_cmd *q, int n) {
+    int added = 0;
+    for (int i = 0; i < n; i++) {
+        if (q[i].op == CMD_GET || (q[i].op == CMD_CAS && q[i].version != 0) || kv_find_locked(q[i].key))
+            continue;
+        int seen = 0;
+        for (int j = 0; j < i && !seen; j++)
+            seen = q[j].op != CMD_GET && strcmp(q[j].key, q[i].key) == 0;
+        if (!seen) added++;
+    }
+    return store_count + added <= MAX_ENTRIES;
+}
+
+/* Run all queued commands atomically; one reply line per command goes to out.
+ * If the store cannot take the new keys, nothing runs and the reply is ERROR. */
+static size_t exec_queued(const queued_cmd *q, int n, char *out, size_t outlen) {
+    size_t len = 0;
+    store_acquire();
+    if (!kv_room_locked(q, n)) {
+        store_release();
+        return snprintf(out, outlen, "ERROR\n");
+    }
+    for (int i = 0; i < n && len < outlen; i++) {
+        if (q[i].op == CMD_SET) {
+            len += snprintf(out + len, outlen - len,
+                            kv_set_locked(q[i].key, q[i].value) ? "OK\n" : "ERROR\n");
+        } else if (q[i].op == CMD_CAS) {
+            uint64_t version;
+            int rc = kv_cas_locked(q[i].key, q[i].version, q[i].value, &version);
+            len += format_cas(out + len, outlen - len, rc, version);
+        } else {
+            keyvalue *kv = kv_find_locked(q[i].key);
+            char ibuf[INT_STRLEN];
+            len += snprintf(out + len, outlen - len, "%s\n",
+                            !kv ? "NOT_FOUND" :
+                            kv->value.enc == OBJ_BLOB ? "TOO_LARGE" : obj_str(&kv->value, ibuf, NULL));
         }
     }
+    store_release();
+    return len < outlen ? len : outlen - 1;
+}
 
-    if (store_count < MAX_ENTRIES) {
-        strncpy(store[store_count].key, key, BUF_SIZE - 1);
-        strncpy(store[store_count].value, value, BUF_SIZE - 1);
-        store[store_count].key[BUF_SIZE - 1] = '\0';
-        store[store_count].value[BUF_SIZE - 1] = '\0';
-        store_count++;
+/* MSET k1 v1 k2 v2 ...: all pairs become visible together. Returns 0 on success,
+ * -1 (having set nothing) on a malformed list or if the store cannot take the
+ * new keys. */
+static int kv_mset(char *args) {
+    queued_cmd q[MAX_QUEUED];
+    int n = 0;
+    char *save, *k, *v;
+
+    for (k = strtok_r(args, " ", &save); k; k = strtok_r(NULL, " ", &save)) {
+        v = strtok_r(NULL, " ", &save);
+        if (!v || n == MAX_QUEUED) return -1;
+        q[n].op = CMD_SET;
+        snprintf(q[n].key, BUF_SIZE, "%s", k);
+        snprintf(q[n].value, BUF_SIZE, "%s", v);
+        n++;
     }
-    pthread_mutex_unlock(&store_lock);
+    if (n == 0) return -1;
+
+    int rc = 0;
+    store_acquire();
+    if (!kv_room_locked(q, n)) rc = -1;
+    for (int i = 0; i < n && rc == 0; i++)
+        if (!kv_set_locked(q[i].key, q[i].value)) rc = -1; // out of memory
+    store_release();
+    return rc;
 }
 
 /* --------------------- Error Exit --------------------- */
@@ -63,52 +736,1605 @@ static void die(const char *msg) {
     exit(EXIT_FAILURE);
 }
 
-/* --------------------- Client Handler Thread --------------------- */
+/* --------------------- Busy Polling and CPU Pinning --------------------- */
+/* --busy-poll=USEC: before a handler sleeps in read/recvmmsg it polls its socket
+ * with a zero timeout for up to that long, so a request that arrives soon after
+ * the last reply is picked up without a scheduler wakeup. The spin is per
+ * connection and adapts: back to the full budget when input arrived shortly after
+ * giving up, halved when the client went quiet, so idle clients stop costing CPU.
+ * --cpus=LIST pins handler (or reactor) threads round-robin to those CPUs
+ * (ideally ones kept free of other work with isolcpus=), so spinners do not
+ * fight each other or get migrated away from warm caches. */
+static long busy_poll_ns;  // 0: always block
+static __thread struct coro *coro_self; // running coroutine; NULL on handler threads
+static int pin_list[CPU_SETSIZE], pin_count;
+static unsigned pin_next;  // atomic
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* Return once fd is readable (or has an error/EOF to report), spinning for up to
+ * *spin_ns before sleeping in poll for up to timeout_ms (-1: no limit). Returns 0
+ * without waiting unless --busy-poll is set, 1 once readable, -1 on timeout. */
+static int busy_poll(int fd, long *spin_ns, int timeout_ms) {
+    if (busy_poll_ns == 0 || coro_self) return 0; // reactors spin in epoll_wait instead
+    struct pollfd p = { .fd = fd, .events = POLLIN };
+    uint64_t start = now_ns(), deadline = start + *spin_ns;
+    do {
+        if (poll(&p, 1, 0) > 0) {
+            __atomic_add_fetch(&poll_hits, 1, __ATOMIC_RELAXED);
+            return 1;
+        }
+    } while (now_ns() < deadline);
+
+    __atomic_add_fetch(&poll_sleeps, 1, __ATOMIC_RELAXED);
+    int rc;
+    while ((rc = poll(&p, 1, timeout_ms)) < 0 && errno == EINTR)
+        ;
+    if (rc == 0) return -1;
+    if (now_ns() - start < 2 * (uint64_t)busy_poll_ns)
+        *spin_ns = busy_poll_ns; // a longer spin would have caught it
+    else
+        *spin_ns /= 2;           // idle: one poll is still tried every time
+    return 1;
+}
+
+/* --cpus=LIST, e.g. "2,3" or "2-5". Returns -1 on a malformed list. */
+static int parse_cpus(const char *spec) {
+    char *end;
+    while (*spec) {
+        long lo = strtol(spec, &end, 10), hi = lo;
+        if (end == spec) return -1;
+        if (*end == '-') {
+            spec = end + 1;
+            hi = strtol(spec, &end, 10);
+            if (end == spec) return -1;
+        }
+        if (lo < 0 || hi < lo || hi >= CPU_SETSIZE) return -1;
+        for (long cpu = lo; cpu <= hi && pin_count < CPU_SETSIZE; cpu++)
+            pin_list[pin_count++] = cpu;
+        if (*end == ',') end++;
+        else if (*end) return -1;
+        spec = end;
+    }
+    return pin_count ? 0 : -1;
+}
+
+/* Pin a new handler or reactor thread to the next CPU of --cpus, if given. */
+static void pin_thread(pthread_t tid) {
+    if (pin_count == 0) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(pin_list[__atomic_fetch_add(&pin_next, 1, __ATOMIC_RELAXED) % pin_count], &set);
+    pthread_setaffinity_np(tid, sizeof(set), &set);
+}
+
+/* --------------------- Admission Control --------------------- */
+/* Under overload, work that cannot be served in time is turned away up front
+ * with a cheap "BUSY" instead of queueing and dragging everyone's latency up.
+ * --max-clients=N caps connections: the ones past it get BUSY and are closed.
+ * --max-inflight=N caps commands executing at once on handler threads (the rest
+ * wait for a slot); reactors already run one at a time each. Either way each
+ * worker watches how long commands wait before they run and sheds CoDel-style:
+ * once that delay has stayed above CODEL_TARGET_MS for CODEL_INTERVAL_MS, it
+ * answers BUSY to commands at a rate rising with the square root of the drop
+ * count until the delay falls back. A BUSY command had no effect and can be
+ * retried. For CODEL_INTERVAL_MS after any worker has shed, new connections are
+ * turned away first, so clients already admitted keep their share. */
+typedef struct {
+    uint64_t first_above; // when the delay may count as persistent; 0: below target
+    uint64_t drop_next;
+    unsigned count;
+    int dropping;
+} codel;
+
+static int max_clients, max_inflight; // 0: no limit / no admission control
+static unsigned long clients, clients_rejected, requests_shed; // atomic
+static uint64_t shed_until;           // new clients are refused until then (atomic)
+
+/* QoS: a client may declare its class with "HELLO interactive|batch"
+ * (interactive by default). Wherever commands queue for service they are taken
+ * in start-time fair queueing order: a command of class c costing k (commands
+ * it amounts to) is tagged max(vtime, c's previous tag + its cost) and the
+ * smallest tag goes next, each class's cost scaled by QOS_SCALE / its weight.
+ * With both classes backlogged interactive gets QOS_W_INTERACTIVE commands
+ * served per batch one; an idle class gives its share to the other. The queues
+ * are the --max-inflight gate on handler threads and each reactor's ready list. */
+enum { QOS_INTERACTIVE, QOS_BATCH, QOS_CLASSES };
+static const char *const qos_names[QOS_CLASSES] = { "interactive", "batch" };
+static const unsigned qos_weight[QOS_CLASSES] = { QOS_W_INTERACTIVE, QOS_W_BATCH };
+static unsigned long qos_cmds[QOS_CLASSES]; // atomic
+
+typedef struct wfq_node {
+    struct wfq_node *next;
+    uint64_t tag;
+} wfq_node;
+
+typedef struct {
+    wfq_node *head[QOS_CLASSES], *tail[QOS_CLASSES];
+    uint64_t vtime;             // tag of the last one taken
+    uint64_t next[QOS_CLASSES]; // earliest tag for the class's next arrival
+    int len;
+} wfq;
+
+static void wfq_push(wfq *q, int cls, wfq_node *n, unsigned cost) {
+    n->tag = q->next[cls] > q->vtime ? q->next[cls] : q->vtime;
+    q->next[cls] = n->tag + (uint64_t)cost * (QOS_SCALE / qos_weight[cls]);
+    n->next = NULL;
+    if (q->tail[cls]) q->tail[cls]->next = n;
+    else q->head[cls] = n;
+    q->tail[cls] = n;
+    q->len++;
+}
+
+static wfq_node *wfq_pop(wfq *q) {
+    int best = -1;
+    for (int c = 0; c < QOS_CLASSES; c++)
+        if (q->head[c] && (best < 0 || q->head[c]->tag < q->head[best]->tag)) best = c;
+    if (best < 0) return NULL;
+    wfq_node *n = q->head[best];
+    if (!(q->head[best] = n->next)) q->tail[best] = NULL;
+    q->len--;
+    q->vtime = n->tag;
+    return n;
+}
+
+static int qos_parse(const char *name) {
+    for (int c = 0; c < QOS_CLASSES; c++)
+        if (strcmp(name, qos_names[c]) == 0) return c;
+    return -1;
+}
+
+// handler threads: the --max-inflight gate; waiters queue in adm_queue
+typedef struct {
+    wfq_node node;      // first: adm_queue hands back this
+    pthread_cond_t cv;
+    int granted;        // a slot was passed to us
+} adm_waiter;
+
+static pthread_mutex_t adm_lock = PTHREAD_MUTEX_INITIALIZER;
+static wfq adm_queue;
+static int adm_running;
+static codel adm_codel;
+
+// reactor threads: their CoDel state, and how long the running coroutine's event
+// waited behind the others of its epoll_wait batch
+static __thread codel *worker_codel;
+static __thread uint64_t worker_delay;
+
+static uint64_t isqrt(uint64_t x) {
+    uint64_t r = 0;
+    for (uint64_t bit = 1ull << 62; bit; bit >>= 2) {
+        if (x >= r + bit) {
+            x -= r + bit;
+            r = (r >> 1) + bit;
+        } else {
+            r >>= 1;
+        }
+    }
+    return r;
+}
+
+static uint64_t codel_next(uint64_t t, unsigned count) {
+    return t + CODEL_INTERVAL_MS * 1000000ull / isqrt(count ? count : 1);
+}
+
+/* RFC 8289's dequeue decision for a command that waited sojourn ns. Returns 1
+ * if it is to be shed. */
+static int codel_shed(codel *cd, uint64_t sojourn, uint64_t now) {
+    int ok_to_drop = 0;
+    if (sojourn < CODEL_TARGET_MS * 1000000ull) {
+        cd->first_above = 0;
+    } else if (cd->first_above == 0) {
+        cd->first_above = now + CODEL_INTERVAL_MS * 1000000ull;
+    } else {
+        ok_to_drop = now >= cd->first_above;
+    }
+
+    if (cd->dropping) {
+        if (!ok_to_drop) {
+            cd->dropping = 0;
+            return 0;
+        }
+        if (now < cd->drop_next) return 0;
+        cd->drop_next = codel_next(cd->drop_next, ++cd->count);
+        return 1;
+    }
+    if (!ok_to_drop) return 0;
+    cd->dropping = 1;
+    // recently dropping: resume near the old rate rather than from scratch
+    cd->count = cd->count > 2 && now - cd->drop_next < 8 * CODEL_INTERVAL_MS * 1000000ull ?
+                cd->count - 2 : 1;
+    cd->drop_next = codel_next(now, cd->count);
+    return 1;
+}
+
+/* A new connection: 0 to serve it, -1 to turn it away. */
+static int admit_client(void) {
+    if ((max_inflight && now_ns() < __atomic_load_n(&shed_until, __ATOMIC_RELAXED)) ||
+        (max_clients && __atomic_load_n(&clients, __ATOMIC_RELAXED) >= (unsigned long)max_clients)) {
+        __atomic_add_fetch(&clients_rejected, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    __atomic_add_fetch(&clients, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void client_gone(void) {
+    __atomic_sub_fetch(&clients, 1, __ATOMIC_RELAXED);
+}
+
+/* --------------------- Coroutines --------------------- */
+/* --reactors=N runs connections as coroutines on N event-loop threads instead of
+ * one thread each. Handler code stays sequential: when a read or send on its
+ * (non-blocking) socket would block, co_wait() arms the socket in the reactor's
+ * epoll set and switches back to the reactor, which resumes the handler once the
+ * socket is ready. A coroutine costs its struct plus a CORO_STACK stack, of
+ * which only the pages it touches use memory. Stacks are carved CORO_SLAB at a
+ * time out of one mapping: a mapping (and a guard page) per stack would take two
+ * of the vm.max_map_count (65530) mappings per connection. One guard page sits
+ * below each slab; every other stack would overflow into its neighbour, so each
+ * has a canary at the bottom, checked whenever its coroutine switches back, and
+ * the server aborts if it is gone. Finished coroutines are kept per reactor for
+ * the next connection; past CORO_POOL their stack pages go back to the kernel.
+ * swapcontext() also saves and restores the signal mask, a sigprocmask system
+ * call per switch. */
+typedef struct reactor reactor;
+
+typedef struct coro {
+    wfq_node qnode;     // first: the ready list hands back this
+    ucontext_t ctx;
+    reactor *r;
+    void *(*fn)(void *); // handler; NULL once it has returned
+    void *arg;
+    char *stack;        // CORO_STACK bytes, canary at the bottom
+    struct coro *next;  // reactor's pool
+    int cls, ran;       // QoS class, commands run since last resumed
+    uint64_t ready_at;  // when put on the ready list
+    // while in a co_wait with a timeout: entry in the reactor's timer wheel
+    int wait_fd, timed_out;
+    uint64_t expire;    // tick
+    struct coro *tnext, **tprev;
+} coro;
+
+struct reactor {
+    int epfd;
+    int pipe[2];        // accept threads -> reactor: handoff records
+    ucontext_t main;    // the reactor loop, while a coroutine runs
+    coro *pool;         // finished, stack pages still resident
+    int pooled;
+    coro *cold;         // finished, stack pages given back
+    char *slab;         // next stack to carve,
+    int slab_left;      // and how many are left
+    wfq ready;          // coroutines whose sockets are ready, or that yielded
+    coro *wheel[WHEEL_SLOTS]; // timers by expire % WHEEL_SLOTS, any lap
+    uint64_t tick;      // next tick to expire
+    int timers;
+};
+
+typedef struct {
+    int fd;
+    void *(*fn)(void *);
+} handoff;
+
+static reactor *reactors;
+static int nreactors;           // 0: a thread per connection
+static unsigned next_reactor;   // atomic
+static size_t page_size;
+
+static void coro_main(void) {
+    coro *co = coro_self;
+    co->fn(co->arg);
+    co->fn = NULL; // returns through uc_link to the reactor, which recycles co
+}
+
+/* A fresh CORO_STACK stack from r's current slab, mapping a new one if needed. */
+static char *coro_stack(reactor *r) {
+    if (r->slab_left == 0) {
+        char *mem = mmap(NULL, page_size + (size_t)CORO_SLAB * CORO_STACK, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) return NULL;
+        mprotect(mem, page_size, PROT_NONE); // the slab's lowest stack faults on overflow
+        r->slab = mem + page_size;
+        r->slab_left = CORO_SLAB;
+    }
+    char *stack = r->slab;
+    r->slab += CORO_STACK;
+    r->slab_left--;
+    return stack;
+}
+
+static coro *coro_new(reactor *r, void *(*fn)(void *), void *arg) {
+    coro *co = r->pool;
+    if (co) {
+        r->pool = co->next;
+        r->pooled--;
+    } else if ((co = r->cold)) {
+        r->cold = co->next;
+    } else {
+        if (!(co = malloc(sizeof(coro)))) return NULL;
+        if (!(co->stack = coro_stack(r))) {
+            free(co);
+            return NULL;
+        }
+    }
+    *(uint64_t *)co->stack = CORO_CANARY;
+    getcontext(&co->ctx);
+    co->ctx.uc_stack.ss_sp = co->stack;
+    co->ctx.uc_stack.ss_size = CORO_STACK;
+    co->ctx.uc_link = &r->main;
+    makecontext(&co->ctx, coro_main, 0);
+    co->r = r;
+    co->fn = fn;
+    co->arg = arg;
+    co->tprev = NULL;
+    co->cls = QOS_INTERACTIVE;
+    co->ran = 0;
+    return co;
+}
+
+/* Run co until it waits for I/O or finishes; a finished one goes back to the pool. */
+static void coro_resume(coro *co) {
+    reactor *r = co->r;
+    coro_self = co;
+    swapcontext(&r->main, &co->ctx);
+    coro_self = NULL;
+    slow_cur = NULL; // co's own, saved by co_wait/co_yield: not the next one's
+    if (*(uint64_t *)co->stack != CORO_CANARY) {
+        fprintf(stderr, "coroutine stack overflow\n");
+        abort(); // a neighbouring stack is corrupt too
+    }
+    if (co->fn) return;
+    if (r->pooled < CORO_POOL) {
+        co->next = r->pool;
+        r->pool = co;
+        r->pooled++;
+    } else {
+        // slab stacks cannot be unmapped one by one; their pages can
+        madvise(co->stack, CORO_STACK, MADV_DONTNEED);
+        co->next = r->cold;
+        r->cold = co;
+    }
+}
+
+/* Timeouts: a waiting coroutine sits in slot expire % WHEEL_SLOTS of its
+ * reactor's wheel; each tick the reactor resumes those of that slot that are due
+ * (the others are a lap or more out), so adding and removing are O(1). */
+static uint64_t now_tick(void) {
+    return now_ns() / (WHEEL_TICK_MS * 1000000ull);
+}
+
+static void timer_add(reactor *r, coro *co, int timeout_ms) {
+    co->expire = now_tick() + (timeout_ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+    if (co->expire < r->tick) co->expire = r->tick;
+    coro **slot = &r->wheel[co->expire % WHEEL_SLOTS];
+    co->tnext = *slot;
+    if (*slot) (*slot)->tprev = &co->tnext;
+    co->tprev = slot;
+    *slot = co;
+    r->timers++;
+}
+
+static void timer_del(coro *co) {
+    if (!co->tprev) return;
+    *co->tprev = co->tnext;
+    if (co->tnext) co->tnext->tprev = co->tprev;
+    co->tprev = NULL;
+    co->r->timers--;
+}
+
+/* Resume the coroutines whose waits have timed out, after disarming their fds. */
+static void timers_expire(reactor *r) {
+    uint64_t end = now_tick() + 1;
+    if (r->timers == 0) {
+        r->tick = end;
+        return;
+    }
+    if (end - r->tick > WHEEL_SLOTS) r->tick = end - WHEEL_SLOTS; // each slot once is enough
+    for (; r->tick < end; r->tick++) {
+        for (coro *co = r->wheel[r->tick % WHEEL_SLOTS], *next; co; co = next) {
+            next = co->tnext;
+            if (co->expire >= end) continue;
+            timer_del(co);
+            co->timed_out = 1;
+            struct epoll_event ev = { .events = 0 };
+            epoll_ctl(r->epfd, EPOLL_CTL_MOD, co->wait_fd, &ev);
+            coro_resume(co);
+        }
+    }
+}
+
+/* Wait until fd is ready for events (POLLIN or POLLOUT, which epoll shares), for
+ * at most timeout_ms (-1: no limit). On a coroutine this yields to its reactor;
+ * on a handler thread it blocks in poll. Returns 1, or 0 on timeout. */
+static int co_wait(int fd, short events, int timeout_ms) {
+    coro *co = coro_self;
+    if (!co) {
+        struct pollfd p = { .fd = fd, .events = events };
+        int rc;
+        while ((rc = poll(&p, 1, timeout_ms)) < 0 && errno == EINTR)
+            ;
+        return rc != 0; // an error counts as ready: the retried call reports it
+    }
+    struct epoll_event ev = { .events = (uint32_t)events | EPOLLONESHOT, .data.ptr = co };
+    if (epoll_ctl(co->r->epfd, EPOLL_CTL_MOD, fd, &ev) < 0 && errno == ENOENT)
+        epoll_ctl(co->r->epfd, EPOLL_CTL_ADD, fd, &ev);
+    co->wait_fd = fd;
+    co->timed_out = 0;
+    if (timeout_ms >= 0) timer_add(co->r, co, timeout_ms);
+    slow_req *timing = slow_cur; // other coroutines run meanwhile
+    swapcontext(&co->ctx, &co->r->main);
+    slow_cur = timing;
+    timer_del(co);
+    return !co->timed_out;
+}
+
+/* Back onto the ready list, behind whatever its class's share says should run
+ * first. */
+static void co_yield(void) {
+    coro *co = coro_self;
+    co->ready_at = now_ns();
+    wfq_push(&co->r->ready, co->cls, &co->qnode, co->ran);
+    slow_req *timing = slow_cur;
+    swapcontext(&co->ctx, &co->r->main);
+    slow_cur = timing;
+}
+
+/* recv() that waits out EAGAIN with co_wait, at most timeout_ms (-1: no limit)
+ * at a time; then it fails with ETIMEDOUT. EINTR and errors go back to the
+ * caller as usual. */
+static ssize_t co_read(int fd, void *buf, size_t len, int timeout_ms) {
+    ssize_t n;
+    while ((n = recv(fd, buf, len, MSG_DONTWAIT)) < 0 && errno == EAGAIN) {
+        if (!co_wait(fd, POLLIN, timeout_ms)) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+    return n;
+}
+
+/* One event loop: queue coroutines whose sockets are ready on the ready list and
+ * run what was on it in fair-queueing order, resume those whose waits timed
+ * out. A connection handed over by the accept threads gets a new coroutine on
+ * the ready list. With
+ * --busy-poll it first spins on a zero-timeout epoll_wait for that long before
+ * sleeping. */
+static void *reactor_loop(void *arg) {
+    reactor *r = arg;
+    struct epoll_event ev[REACTOR_EVENTS];
+    codel cd = { 0 };
+
+    worker_codel = &cd;
+    for (;;) {
+        int n = 0;
+        if (r->ready.len) {
+            n = epoll_wait(r->epfd, ev, REACTOR_EVENTS, 0); // just look for more
+        } else if (busy_poll_ns) {
+            uint64_t deadline = now_ns() + busy_poll_ns;
+            while ((n = epoll_wait(r->epfd, ev, REACTOR_EVENTS, 0)) == 0 && now_ns() < deadline)
+                ;
+            __atomic_add_fetch(n > 0 ? &poll_hits : &poll_sleeps, 1, __ATOMIC_RELAXED);
+        }
+        if (n <= 0 && !r->ready.len)
+            n = epoll_wait(r->epfd, ev, REACTOR_EVENTS, r->timers ? WHEEL_TICK_MS : -1);
+        uint64_t woke = now_ns();
+
+        for (int i = 0; i < n; i++) {
+            if (ev[i].data.ptr) {
+                coro *co = ev[i].data.ptr;
+                co->ready_at = woke;
+                wfq_push(&r->ready, co->cls, &co->qnode, co->ran ? co->ran : 1);
+                continue;
+            }
+            handoff h;
+            while (read(r->pipe[0], &h, sizeof(h)) == sizeof(h)) {
+                int *fd = malloc(sizeof(int));
+                coro *co = fd ? coro_new(r, h.fn, fd) : NULL;
+                if (!co) {
+                    free(fd);
+                    close(h.fd);
+                    client_gone();
+                    continue;
+                }
+                *fd = h.fd;
+                // starts in the round below, in its class's turn like any other
+                co->ready_at = woke;
+                wfq_push(&r->ready, co->cls, &co->qnode, 1);
+            }
+        }
+        // one round over what is ready now; the ones that yield go to the next
+        for (int round = r->ready.len; round > 0; round--) {
+            coro *co = (coro *)wfq_pop(&r->ready);
+            worker_delay = now_ns() - co->ready_at;
+            co->ran = 0;
+            coro_resume(co);
+        }
+        timers_expire(r);
+    }
+    return NULL;
+}
+
+static void start_reactors(int n) {
+    page_size = sysconf(_SC_PAGESIZE);
+    if (!(reactors = calloc(n, sizeof(reactor)))) die("calloc");
+    for (int i = 0; i < n; i++) {
+        reactor *r = &reactors[i];
+        if ((r->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) die("epoll_create1");
+        if (pipe2(r->pipe, O_CLOEXEC) < 0) die("pipe2");
+        fcntl(r->pipe[0], F_SETFL, O_NONBLOCK);
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->pipe[0], &ev) < 0) die("epoll_ctl");
+        r->tick = now_tick();
+
+        pthread_t tid;
+        pthread_create(&tid, NULL, reactor_loop, r);
+        pin_thread(tid);
+        pthread_detach(tid);
+    }
+    nreactors = n;
+}
+
+/* Give an accepted client to the next reactor. */
+static void reactor_handoff(int fd, void *(*fn)(void *)) {
+    reactor *r = &reactors[__atomic_fetch_add(&next_reactor, 1, __ATOMIC_RELAXED) % nreactors];
+    handoff h = { fd, fn };
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    if (write(r->pipe[1], &h, sizeof(h)) != sizeof(h)) {
+        close(fd);
+        client_gone();
+    }
+}
+
+/* --------------------- Request Scheduling --------------------- */
+/* Hand the gate's slot to the next waiter in fair-queueing order, if any. */
+static void adm_release_locked(void) {
+    adm_waiter *w = (adm_waiter *)wfq_pop(&adm_queue);
+    if (!w) {
+        adm_running--;
+        return;
+    }
+    w->granted = 1; // the slot goes straight to w
+    pthread_cond_signal(&w->cv);
+}
+
+/* Before running a command of class cls that amounts to cost commands: returns
+ * 0 to go ahead (then call admit_done after it), or -1 to answer BUSY. On a
+ * coroutine past its QOS_QUANTUM this first yields the reactor. */
+static int admit_wait(int cls, unsigned cost) {
+    uint64_t now;
+    int shed;
+    __atomic_add_fetch(&qos_cmds[cls], cost, __ATOMIC_RELAXED);
+    if (coro_self) {
+        coro *co = coro_self;
+        co->cls = cls;
+        if (co->ran >= QOS_QUANTUM) {
+            co_yield();
+            co->ran = 0;
+            worker_delay = now_ns() - co->ready_at;
+        }
+        co->ran += cost;
+        if (max_inflight == 0) return 0;
+        now = now_ns();
+        shed = codel_shed(worker_codel, worker_delay, now);
+    } else {
+        if (max_inflight == 0) return 0;
+        uint64_t start = now = now_ns();
+        pthread_mutex_lock(&adm_lock);
+        if (adm_running >= max_inflight && adm_codel.dropping && now >= adm_codel.drop_next) {
+            // a drop is due anyway: take it now rather than after the wait
+            adm_codel.drop_next = codel_next(adm_codel.drop_next, ++adm_codel.count);
+            shed = 1;
+        } else {
+            if (adm_running < max_inflight) {
+                adm_running++;
+            } else {
+                adm_waiter w = { .granted = 0 };
+                pthread_cond_init(&w.cv, NULL);
+                wfq_push(&adm_queue, cls, &w.node, cost);
+                while (!w.granted) pthread_cond_wait(&w.cv, &adm_lock);
+                pthread_cond_destroy(&w.cv);
+            }
+            now = now_ns();
+            if ((shed = codel_shed(&adm_codel, now - start, now))) adm_release_locked();
+        }
+        pthread_mutex_unlock(&adm_lock);
+    }
+    if (!shed) return 0;
+    __atomic_add_fetch(&requests_shed, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&shed_until, now + CODEL_INTERVAL_MS * 1000000ull, __ATOMIC_RELAXED);
+    return -1;
+}
+
+/* admit_wait, timed as the queue phase of a slow log entry where it can wait. */
+static int admit(int cls, unsigned cost) {
+    int rc = admit_wait(cls, cost);
+    if (max_inflight || coro_self) slow_stamp(SLOW_ADMIT);
+    return rc;
+}
+
+static void admit_done(void) {
+    if (max_inflight == 0 || coro_self) return;
+    pthread_mutex_lock(&adm_lock);
+    adm_release_locked();
+    pthread_mutex_unlock(&adm_lock);
+}
+
+/* --------------------- Idle Connections --------------------- */
+/* With --idle-timeout=SECS a connection that sends nothing for that long while
+ * the server waits for its input (a next command, the rest of a line or of a
+ * SETL payload) is closed. The wait itself carries the deadline: poll's timeout
+ * on handler threads, the reactor's timer wheel on coroutines, so nothing ever
+ * scans the connections. TCP connections also get keepalive probes
+ * (--keepalive=SECS, 0 for none), so a peer that vanished without a FIN or RST
+ * is noticed even with no idle timeout. */
+static int idle_secs = IDLE_SECS, keepalive_secs = KEEPALIVE_SECS;
+static unsigned long idle_closed; // atomic
+
+/* Timeout for an input wait: -1 for none. */
+static int idle_ms(void) {
+    return idle_secs ? idle_secs * 1000 : -1;
+}
+
+static void idle_expired(void) {
+    __atomic_add_fetch(&idle_closed, 1, __ATOMIC_RELAXED);
+}
+
+static void set_keepalive(int fd) {
+    int one = 1, idle = keepalive_secs, intvl = keepalive_secs / KEEPALIVE_PROBES, cnt = KEEPALIVE_PROBES;
+    if (keepalive_secs == 0) return;
+    if (intvl == 0) intvl = 1;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
+}
+
+/* --------------------- Buffer Pool --------------------- */
+/* Connections hold an IOBUF_SIZE buffer only while data is in flight. Input is
+ * read into one taken from this pool, which goes back once it is drained and
+ * the connection has to wait for more; replies are built in one that goes back
+ * after the send. Up to IOBUF_POOL idle buffers are kept and the rest freed, so
+ * a mostly-idle connection costs no buffer memory at all. */
+typedef struct iobuf {
+    struct iobuf *next;
+} iobuf;
+
+static iobuf *iobuf_free;
+static int iobuf_pooled;         // length of iobuf_free, under iobuf_lock
+static unsigned long iobufs_in_use; // atomic
+static pthread_mutex_t iobuf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *iobuf_get(void) {
+    pthread_mutex_lock(&iobuf_lock);
+    iobuf *b = iobuf_free;
+    if (b) {
+        iobuf_free = b->next;
+        iobuf_pooled--;
+    }
+    pthread_mutex_unlock(&iobuf_lock);
+    if (!b && !(b = malloc(IOBUF_SIZE))) return NULL;
+    __atomic_add_fetch(&iobufs_in_use, 1, __ATOMIC_RELAXED);
+    return (char *)b;
+}
+
+static void iobuf_put(char *p) {
+    if (!p) return;
+    __atomic_sub_fetch(&iobufs_in_use, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&iobuf_lock);
+    if (iobuf_pooled < IOBUF_POOL) {
+        iobuf *b = (iobuf *)p;
+        b->next = iobuf_free;
+        iobuf_free = b;
+        iobuf_pooled++;
+        p = NULL;
+    }
+    pthread_mutex_unlock(&iobuf_lock);
+    free(p);
+}
+
+/* Nothing buffered and the socket has nothing either: give *buf back while
+ * waiting for input (busy-polling first, with --busy-poll). Returns 1 once there
+ * is some, 0 if the client stayed idle past --idle-timeout. */
+static int wait_input(int fd, char **buf, long *spin_ns) {
+    iobuf_put(*buf);
+    *buf = NULL;
+    int rc = busy_poll(fd, spin_ns, idle_ms());
+    if (rc == 0) rc = co_wait(fd, POLLIN, idle_ms()) ? 1 : -1;
+    if (rc > 0) return 1;
+    idle_expired();
+    return 0;
+}
+
+/* --------------------- Connection I/O --------------------- */
+/* Commands are '\n'-terminated lines. A SETL payload follows its command line as
+ * raw bytes, so input is buffered per connection: lines are split off the buffer,
+ * payloads drain what is buffered and then read straight into value chunks. */
+typedef struct {
+    uint32_t last;      // completion id of the blob's last zero-copy send
+    kv_blob *b;
+} zc_hold;
+
+typedef struct conn {
+    int fd;
+    size_t start, end;  // unread input is in[start, end)
+    long spin_ns;       // current busy-poll spin
+    char *in;           // IOBUF_SIZE pooled buffer while input is pending, else NULL
+    // zero-copy state (TCP only)
+    int zerocopy;
+    uint32_t zc_next;   // id the kernel gives our next MSG_ZEROCOPY send
+    int zc_head, zc_len, zc_copied_streak;
+    zc_hold zc[ZC_HOLDS]; // blobs the kernel may still be reading, oldest first
+    int zc_orphaned;    // some holds went to the reaper along with a dup of fd
+    int zc_unsent;      // orphans: send queue size when last looked at,
+    uint64_t zc_stuck_since; // unchanged since then
+    struct conn *zc_next_orphan; // reaper list link (orphans only)
+    // replies not sent yet
+    struct outchunk *out_head, *out_tail;
+    size_t out_len;
+} conn;
+
+static int conn_flush(conn *c);
+
+/* More input into c->in, taking a buffer from the pool for it; while the socket
+ * has nothing and nothing is buffered, the buffer goes back. */
+static ssize_t conn_fill(conn *c) {
+    for (;;) {
+        if (!c->in && !(c->in = iobuf_get())) return -1;
+        ssize_t n = recv(c->fd, c->in + c->end, IOBUF_SIZE - c->end, MSG_DONTWAIT);
+        if (n >= 0 || errno != EAGAIN) return n;
+        if (conn_flush(c) < 0) return -1; // replies go out before we wait for more
+        if (c->end > 0) { // keep the partial line
+            if (!co_wait(c->fd, POLLIN, idle_ms())) {
+                idle_expired();
+                return -1;
+            }
+        } else if (!wait_input(c->fd, &c->in, &c->spin_ns)) {
+            return -1;
+        }
+    }
+}
+
+/* Next line, without its "\r\n", into line (BUF_SIZE bytes). Returns its length,
+ * -1 on EOF or error, or -2 for a line too long for BUF_SIZE (which is skipped). */
+static ssize_t conn_read_line(conn *c, char *line) {
+    int too_long = 0;
+    for (;;) {
+        char *p = c->in + c->start;
+        char *nl = c->end > c->start ? memchr(p, '\n', c->end - c->start) : NULL;
+        if (nl) {
+            size_t len = nl - p;
+            c->start += len + 1;
+            if (too_long || len >= BUF_SIZE) return -2;
+            if (len > 0 && p[len - 1] == '\r') len--;
+            memcpy(line, p, len);
+            line[len] = '\0';
+            return len;
+        }
+        if (c->end - c->start >= BUF_SIZE) {
+            too_long = 1; // drop what we have, keep looking for the newline
+            c->start = c->end;
+        }
+        if (c->start > 0) {
+            memmove(c->in, c->in + c->start, c->end - c->start);
+            c->end -= c->start;
+            c->start = 0;
+        }
+        ssize_t n = conn_fill(c);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        c->end += n;
+    }
+}
+
+/* Exactly len bytes into dst. Returns 0, or -1 on EOF or error. */
+static int conn_read_bytes(conn *c, char *dst, size_t len) {
+    size_t have = c->end - c->start;
+    if (have > len) have = len;
+    if (have) memcpy(dst, c->in + c->start, have);
+    c->start += have;
+    while (have < len) {
+        ssize_t n = co_read(c->fd, dst + have, len - have, idle_ms());
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == ETIMEDOUT) idle_expired();
+        if (n <= 0) return -1;
+        have += n;
+    }
+    return 0;
+}
+
+/* Read and drop len bytes: a payload that will not be stored. */
+static int conn_skip_bytes(conn *c, size_t len) {
+    char scratch[4096];
+    while (len > 0) {
+        size_t n = len < sizeof(scratch) ? len : sizeof(scratch);
+        if (conn_read_bytes(c, scratch, n) < 0) return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Fill b's chunks from the connection, allocating each as its data arrives, so a
+ * client announcing a huge value only costs what it actually sends. */
+static int conn_read_blob(conn *c, kv_blob *b) {
+    for (int i = 0; i < b->nchunks; i++) {
+        size_t len = chunk_len(b, i);
+        if (!(b->chunks[i] = malloc(len)) || conn_read_bytes(c, b->chunks[i], len) < 0)
+            return -1;
+        blob_pack_chunk(b, i);
+    }
+    return 0;
+}
+
+/* --------------------- Zero-copy Sends --------------------- */
+/* Big GETL replies on TCP go out with MSG_ZEROCOPY: the kernel transmits straight
+ * from the value chunks instead of copying them into socket buffers, and later
+ * reports on the socket's error queue which sends it is done with. Each such
+ * reply keeps a blob reference in c->zc until then, so an overwrite or a
+ * disconnect cannot free pages that are still going out. Unix sockets do not
+ * support it (SO_ZEROCOPY fails) and keep the copying path. */
+static void zc_enable(conn *c) {
+    int one = 1;
+    if (coro_self) return; // zc_reap's waits would stall the whole reactor
+    c->zerocopy = setsockopt(c->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+}
+
+/* Drop the holds the kernel has reported done. timeout_ms 0 only looks at what
+ * is queued; otherwise wait up to timeout_ms in all for the rest. Returns early
+ * once the socket hangs up or fails, since no completion will wake poll then. */
+static void zc_reap(conn *c, int timeout_ms) {
+    uint64_t until = now_ns() + timeout_ms * 1000000ull;
+    while (c->zc_len > 0) {
+        char ctrl[128];
+        struct msghdr msg = { .msg_control = ctrl, .msg_controllen = sizeof(ctrl) };
+        if (recvmsg(c->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN || timeout_ms == 0) return;
+            uint64_t now = now_ns();
+            if (now >= until) return;
+            struct pollfd p = { .fd = c->fd, .events = 0 }; // POLLERR/POLLHUP are always reported
+            if (poll(&p, 1, (int)((until - now + 999999) / 1000000)) <= 0) return;
+            if (p.revents & (POLLHUP | POLLNVAL)) return;
+            int err = 0;
+            socklen_t len = sizeof(err);
+            // POLLERR with an empty error queue is a socket error: clear it once
+            if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) return;
+            continue;
+        }
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+            struct sock_extended_err *ee = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+            // sends ee_info..ee_data are done
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                __atomic_add_fetch(&zc_copied, ee->ee_data - ee->ee_info + 1, __ATOMIC_RELAXED);
+                if (++c->zc_copied_streak >= ZC_COPIED_MAX)
+                    c->zerocopy = 0; // e.g. loopback: pinning pages only costs here
+            } else {
+                c->zc_copied_streak = 0;
+            }
+            while (c->zc_len > 0 && (int32_t)(c->zc[c->zc_head].last - ee->ee_data) <= 0) {
+                blob_unref(c->zc[c->zc_head].b);
+                c->zc_head = (c->zc_head + 1) % ZC_HOLDS;
+                c->zc_len--;
+            }
+        }
+    }
+}
+
+/* Holds whose completions had not come in when their connection closed (or ran
+ * out of holds) wait here, each with its own dup of the socket, until the kernel
+ * reports them done or has nothing of ours left to send. Freeing them earlier
+ * could let the allocator reuse pages that are still being transmitted. A peer
+ * that stopped reading would pin them forever, so once the send queue has not
+ * moved for ZC_STUCK_MS the connection is reset, which purges it. */
+static conn *zc_orphans;
+static pthread_mutex_t zc_orphan_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t zc_orphan_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t zc_reaper_once = PTHREAD_ONCE_INIT;
+
+/* Bytes fd has not had acknowledged yet; 0 once everything has been, or the
+ * connection is gone (a reset purges the send queue): then the kernel holds none
+ * of our pages. */
+static int zc_unsent(int fd) {
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    int outq;
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0 || ti.tcpi_state == TCP_CLOSE)
+        return 0;
+    return ioctl(fd, SIOCOUTQ, &outq) == 0 ? outq : -1;
+}
+
+/* Reset the TCP connection behind fd at once, whoever else has it open: the
+ * kernel drops what it still had to send and the peer gets an RST. */
+static void tcp_reset(int fd) {
+    struct sockaddr sa = { .sa_family = AF_UNSPEC };
+    connect(fd, &sa, sizeof(sa));
+}
+
+static void *zc_reaper(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&zc_orphan_lock);
+        while (!zc_orphans) pthread_cond_wait(&zc_orphan_cond, &zc_orphan_lock);
+        conn *list = zc_orphans;
+        zc_orphans = NULL;
+        pthread_mutex_unlock(&zc_orphan_lock);
+
+        conn *keep = NULL;
+        while (list) {
+            conn *o = list;
+            list = o->zc_next_orphan;
+            zc_reap(o, 0);
+            int unsent = o->zc_len > 0 ? zc_unsent(o->fd) : 0;
+            if (unsent != 0) {
+                uint64_t now = now_ns();
+                if (unsent != o->zc_unsent) {
+                    o->zc_unsent = unsent;
+                    o->zc_stuck_since = now;
+                } else if (now - o->zc_stuck_since >= ZC_STUCK_MS * 1000000ull) {
+                    tcp_reset(o->fd); // the peer is not reading; released next round
+                }
+                o->zc_next_orphan = keep;
+                keep = o;
+                continue;
+            }
+            while (o->zc_len > 0) {
+                blob_unref(o->zc[o->zc_head].b);
+                o->zc_head = (o->zc_head + 1) % ZC_HOLDS;
+                o->zc_len--;
+            }
+            close(o->fd);
+            free(o);
+        }
+        if (!keep) continue;
+        usleep(ZC_REAP_MS * 1000);
+        pthread_mutex_lock(&zc_orphan_lock);
+        while (keep) {
+            conn *o = keep;
+            keep = o->zc_next_orphan;
+            o->zc_next_orphan = zc_orphans;
+            zc_orphans = o;
+        }
+        pthread_mutex_unlock(&zc_orphan_lock);
+    }
+    return NULL;
+}
+
+static void zc_reaper_start(void) {
+    pthread_t tid;
+    pthread_create(&tid, NULL, zc_reaper, NULL);
+    pthread_detach(tid);
+}
+
+/* Hand c's outstanding holds to the reaper; c keeps no holds afterwards. */
+static void zc_close(conn *c) {
+    zc_reap(c, 0);
+    if (c->zc_len == 0) return;
+    conn *o = calloc(1, sizeof(conn));
+    if (o) o->fd = dup(c->fd);
+    if (!o || o->fd < 0) {
+        // cannot watch the socket: leak the blobs rather than free live pages
+        free(o);
+        c->zc_len = 0;
+        return;
+    }
+    memcpy(o->zc, c->zc, sizeof(c->zc));
+    o->zc_head = c->zc_head;
+    o->zc_len = c->zc_len;
+    o->zc_stuck_since = now_ns();
+    c->zc_len = 0;
+    c->zc_orphaned = 1;
+    pthread_once(&zc_reaper_once, zc_reaper_start);
+    pthread_mutex_lock(&zc_orphan_lock);
+    o->zc_next_orphan = zc_orphans;
+    zc_orphans = o;
+    pthread_cond_signal(&zc_orphan_cond);
+    pthread_mutex_unlock(&zc_orphan_lock);
+}
+
+/* Keep b alive until the send with id last completes. */
+static void zc_hold_blob(conn *c, kv_blob *b, uint32_t last) {
+    if (c->zc_len == ZC_HOLDS) zc_reap(c, ZC_FULL_WAIT_MS);
+    if (c->zc_len == ZC_HOLDS) { // kernel is not reporting: stop using zero-copy
+        c->zerocopy = 0;
+        zc_close(c);
+    }
+    c->zc[(c->zc_head + c->zc_len) % ZC_HOLDS] = (zc_hold){ last, blob_ref(b) };
+    c->zc_len++;
+}
+
+/* --------------------- Output Limits --------------------- */
+/* A client that sends commands faster than it reads the replies must not pin
+ * memory or a handler indefinitely. Replies to pipelined commands queue up per
+ * connection and go out when its input runs dry; once output_soft bytes are
+ * queued the handler stops taking commands until the client has read them.
+ * Sends never block: a send that cannot make progress waits at most output_secs
+ * for the client, and a stalled client whose backlog (queued plus what the
+ * kernel still holds for it) has reached output_hard is dropped at once. GETL
+ * streams, which copy nothing, are bounded by the stall timeout only. */
+static size_t output_soft = OUTPUT_SOFT, output_hard = OUTPUT_HARD;
+static int output_secs = OUTPUT_SECS;
+static unsigned long out_queued, out_throttled, out_hard_drops, out_stall_drops; // atomic
+
+/* A send to fd would block. queued is what we still have to send it, or -1 for
+ * a GETL stream. Returns 0 once the client can take more, -1 to drop it. */
+static int output_wait(int fd, ssize_t queued) {
+    int outq;
+    if (queued >= 0 && ioctl(fd, SIOCOUTQ, &outq) == 0 && (size_t)outq + queued >= output_hard) {
+        __atomic_add_fetch(&out_hard_drops, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    if (co_wait(fd, POLLOUT, output_secs * 1000)) return 0;
+    __atomic_add_fetch(&out_stall_drops, 1, __ATOMIC_RELAXED);
+    return -1;
+}
+
+/* --output-limit=SOFT,HARD,SECS */
+static int parse_output_limit(const char *spec) {
+    size_t soft, hard;
+    int secs;
+    char end;
+    if (sscanf(spec, "%zu,%zu,%d%c", &soft, &hard, &secs, &end) != 3 ||
+        soft == 0 || hard < soft || secs <= 0 || secs > INT_MAX / 1000)
+        return -1;
+    output_soft = soft;
+    output_hard = hard;
+    output_secs = secs;
+    return 0;
+}
+
+/* --------------------- Connection Output --------------------- */
+/* sendmsg until everything in iov[0..cnt) is out, waiting for a slow client as
+ * output_wait allows (stream: this is a GETL stream). With MSG_ZEROCOPY in
+ * flags, *zc_calls counts the sends that took it (each gets the next completion
+ * id); if the kernel is short of buffers for that, the rest goes out copied.
+ * Returns 0, or -1 on error or if the client is to be dropped. */
+static int send_iov(int fd, struct iovec *iov, int cnt, int flags, uint32_t *zc_calls, int stream) {
+    while (cnt > 0) {
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = cnt };
+        ssize_t n = sendmsg(fd, &msg, flags | MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) {
+            ssize_t queued = 0;
+            for (int i = 0; i < cnt; i++) queued += iov[i].iov_len;
+            if (output_wait(fd, stream ? -1 : queued) < 0) return -1;
+            continue;
+        }
+        if (n < 0 && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+            flags &= ~MSG_ZEROCOPY;
+            continue;
+        }
+        if (n < 0) return -1;
+        if (flags & MSG_ZEROCOPY) {
+            (*zc_calls)++;
+            __atomic_add_fetch(&zc_bytes, n, __ATOMIC_RELAXED);
+        }
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/* GETL reply for a large value: "$<len>\n" then the raw bytes, straight from the
+ * chunks, up to IOV_BATCH chunks per sendmsg (zero-copy when big enough, unless
+ * some chunks are compressed: those go out of one reused scratch buffer). */
+#define IOV_BATCH (IOV_MAX < 64 ? IOV_MAX : 64)
+
+static int stream_blob(conn *c, kv_blob *b) {
+    char hdr[32];
+    struct iovec iov[IOV_BATCH];
+    int n = 0, rc = 0;
+    int flags = c->zerocopy && b->len >= ZC_MIN && !b->clen ? MSG_ZEROCOPY : 0;
+    uint32_t zc_calls = 0;
+    char *scratch = NULL;
+    if (b->clen && !(scratch = malloc(CHUNK_SIZE))) return -1;
+    // the header is on our stack: send it copied, only the chunks go zero-copy
+    n = snprintf(hdr, sizeof(hdr), "$%zu\n", b->len);
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = n;
+    if (flags && send_iov(c->fd, iov, 1, 0, NULL, 1) < 0) return -1;
+    n = flags ? 0 : 1;
+    for (int i = 0; i < b->nchunks && rc == 0; i++) {
+        char *data = b->chunks[i];
+        if (b->clen && b->clen[i]) {
+            // scratch may still be in the batch: send that before refilling it
+            if (n && (rc = send_iov(c->fd, iov, n, flags, &zc_calls, 1)) < 0) break;
+            n = 0;
+            if (!(data = blob_unpack_chunk(b, i, scratch))) {
+                rc = -1;
+                break;
+            }
+        }
+        iov[n].iov_base = data;
+        iov[n++].iov_len = chunk_len(b, i);
+        if (n == IOV_BATCH) {
+            rc = send_iov(c->fd, iov, n, flags, &zc_calls, 1);
+            n = 0;
+        }
+    }
+    if (n && rc == 0) rc = send_iov(c->fd, iov, n, flags, &zc_calls, 1);
+    free(scratch);
+    if (zc_calls) {
+        __atomic_add_fetch(&zc_sends, zc_calls, __ATOMIC_RELAXED);
+        c->zc_next += zc_calls;
+        zc_hold_blob(c, b, c->zc_next - 1);
+        zc_reap(c, 0);
+    }
+    return rc;
+}
+
+/* Queued replies live in pooled buffers, a chunk header followed by the data. */
+typedef struct outchunk {
+    struct outchunk *next;
+    size_t len;
+    char data[];
+} outchunk;
+
+#define OUTCHUNK_CAP (IOBUF_SIZE - sizeof(outchunk))
+
+/* Room for one reply (REPLY_MAX bytes) at the end of c's output queue, or NULL if
+ * no buffer can be had. Queue what was written there with conn_reply. */
+static char *conn_reply_buf(conn *c) {
+    outchunk *t = c->out_tail;
+    if (t && OUTCHUNK_CAP - t->len >= REPLY_MAX) return t->data + t->len;
+    outchunk *o = (outchunk *)iobuf_get();
+    if (!o) return NULL;
+    o->next = NULL;
+    o->len = 0;
+    if (t) t->next = o;
+    else c->out_head = o;
+    c->out_tail = o;
+    return o->data;
+}
+
+static void conn_reply(conn *c, size_t len) {
+    c->out_tail->len += len;
+    c->out_len += len;
+    __atomic_add_fetch(&out_queued, len, __ATOMIC_RELAXED);
+}
+
+/* Throw away up to n queued chunks (n < 0: all of them). */
+static void conn_drop_chunks(conn *c, int n) {
+    while (c->out_head && n-- != 0) {
+        outchunk *o = c->out_head;
+        c->out_head = o->next;
+        c->out_len -= o->len;
+        __atomic_sub_fetch(&out_queued, o->len, __ATOMIC_RELAXED);
+        iobuf_put((char *)o);
+    }
+    if (!c->out_head) c->out_tail = NULL;
+}
+
+static void conn_drop(conn *c) {
+    conn_drop_chunks(c, -1);
+}
+
+/* Send all queued replies; the buffers go back to the pool either way. Returns
+ * 0, or -1 on error or if the client is to be dropped. */
+static int conn_flush(conn *c) {
+    struct iovec iov[IOV_BATCH];
+    while (c->out_head) {
+        int n = 0;
+        for (outchunk *o = c->out_head; o && n < IOV_BATCH; o = o->next) {
+            iov[n].iov_base = o->data;
+            iov[n++].iov_len = o->len;
+        }
+        int rc = send_iov(c->fd, iov, n, 0, NULL, 0);
+        conn_drop_chunks(c, rc < 0 ? -1 : n);
+        if (rc < 0) return -1;
+    }
+    return 0;
+}
+
+/* --------------------- Command Dispatch --------------------- */
+/* Per-connection command state, shared by the stream and seqpacket handlers. */
+typedef struct {
+    queued_cmd queue[MAX_QUEUED];
+    int in_multi, queued, multi_failed;
+    int qos;            // class from HELLO
+} session;
+
+_Static_assert(REPLY_MAX <= OUTCHUNK_CAP, "a reply must fit a pooled buffer");
+_Static_assert(SEQ_BATCH * BUF_SIZE <= IOBUF_SIZE, "a seqpacket batch must fit a pooled buffer");
+
+#define REPLY_FIXED(buf, s) (memcpy(buf, s, sizeof(s) - 1), sizeof(s) - 1)
+#define REPLY(s) REPLY_FIXED(out, s)
+
+/* What a command line amounts to for fair queueing: the pairs of an MSET or the
+ * commands an EXEC runs, else 1. */
+static unsigned command_cost(const session *ss, const char *buf) {
+    if (strncmp(buf, "MSET ", 5) == 0) {
+        unsigned words = 0;
+        for (const char *p = buf + 5; *p; ) {
+            p += strspn(p, " ");
+            if (!*p) break;
+            words++;
+            p += strcspn(p, " ");
+        }
+        return words / 2 ? words / 2 : 1;
+    }
+    if (ss->in_multi && strcmp(buf, "EXEC") == 0 && ss->queued > 0) return ss->queued;
+    return 1;
+}
+
+/* Run one command line (everything but SETL/GETL, whose payloads do not fit a
+ * line); the reply goes to out (REPLY_MAX bytes). Returns the reply length. */
+static size_t run_command(session *ss, const char *buf, char *out) {
+    char key[BUF_SIZE], value[BUF_SIZE], opt[16];
+    uint64_t version;
+    kv_blob *blob;
+    int n;
+
+    if (strcmp(buf, "MULTI") == 0) {
+        if (ss->in_multi) return REPLY("ERROR\n");
+        ss->in_multi = 1;
+        ss->queued = ss->multi_failed = 0;
+        return REPLY("OK\n");
+    } else if (strcmp(buf, "DISCARD") == 0) {
+        if (!ss->in_multi) return REPLY("ERROR\n");
+        ss->in_multi = 0;
+        return REPLY("OK\n");
+    } else if (strcmp(buf, "EXEC") == 0) {
+        if (!ss->in_multi) return REPLY("ERROR\n");
+        ss->in_multi = 0;
+        if (ss->multi_failed) return REPLY("EXECABORT\n");
+        return exec_queued(ss->queue, ss->queued, out, REPLY_MAX);
+    } else if (ss->in_multi) {
+        // queue instead of executing; a bad command poisons the whole batch
+        if (ss->queued == MAX_QUEUED || parse_queued(buf, &ss->queue[ss->queued]) < 0) {
+            ss->multi_failed = 1;
+            return REPLY("ERROR\n");
+        }
+        ss->queued++;
+        return REPLY("QUEUED\n");
+    } else if (sscanf(buf, "HELLO %15s", opt) == 1) {
+        int cls = qos_parse(opt);
+        if (cls < 0) return REPLY("ERROR\n");
+        ss->qos = cls;
+        return REPLY("OK\n");
+    } else if (strncmp(buf, "MSET ", 5) == 0) {
+        char args[BUF_SIZE];
+        snprintf(args, sizeof(args), "%s", buf + 5);
+        return kv_mset(args) == 0 ? REPLY("OK\n") : REPLY("ERROR\n");
+    } else if (strncmp(buf, "SETL ", 5) == 0 || strncmp(buf, "GETL ", 5) == 0) {
+        return REPLY("ERROR\n"); // not on this transport
+    } else if (strncmp(buf, "SLOWLOG ", 8) == 0) {
+        long count = 10;
+        if (strcmp(buf + 8, "LEN") == 0) return snprintf(out, REPLY_MAX, "%" PRIu64 "\n", slowlog_len());
+        if (strcmp(buf + 8, "RESET") == 0) {
+            slowlog_reset();
+            return REPLY("OK\n");
+        }
+        if (strcmp(buf + 8, "GET") == 0 || (sscanf(buf + 8, "GET %ld", &count) == 1 && count >= 0))
+            return slowlog_get(count, out, REPLY_MAX);
+        return REPLY("ERROR\n");
+    } else if (strcmp(buf, "STATS") == 0) {
+        pthread_mutex_lock(&iobuf_lock);
+        int pooled = iobuf_pooled;
+        pthread_mutex_unlock(&iobuf_lock);
+        n = snprintf(out, REPLY_MAX, "zerocopy_sends %lu\nzerocopy_bytes %lu\nzerocopy_copied %lu\n"
+                     "busy_poll_hits %lu\nbusy_poll_sleeps %lu\n"
+                     "iobufs_in_use %lu\niobufs_pooled %d\niobuf_size %d\n"
+                     "output_queued_bytes %lu\noutput_throttled %lu\n"
+                     "output_hard_drops %lu\noutput_stall_drops %lu\n"
+                     "clients %lu\nclients_rejected %lu\nrequests_shed %lu\nshedding %d\n"
+                     "qos_interactive_cmds %lu\nqos_batch_cmds %lu\nidle_closed %lu\n",
+                     __atomic_load_n(&zc_sends, __ATOMIC_RELAXED),
+                     __atomic_load_n(&zc_bytes, __ATOMIC_RELAXED),
+                     __atomic_load_n(&zc_copied, __ATOMIC_RELAXED),
+                     __atomic_load_n(&poll_hits, __ATOMIC_RELAXED),
+                     __atomic_load_n(&poll_sleeps, __ATOMIC_RELAXED),
+                     __atomic_load_n(&iobufs_in_use, __ATOMIC_RELAXED), pooled, IOBUF_SIZE,
+                     __atomic_load_n(&out_queued, __ATOMIC_RELAXED),
+                     __atomic_load_n(&out_throttled, __ATOMIC_RELAXED),
+                     __atomic_load_n(&out_hard_drops, __ATOMIC_RELAXED),
+                     __atomic_load_n(&out_stall_drops, __ATOMIC_RELAXED),
+                     __atomic_load_n(&clients, __ATOMIC_RELAXED),
+                     __atomic_load_n(&clients_rejected, __ATOMIC_RELAXED),
+                     __atomic_load_n(&requests_shed, __ATOMIC_RELAXED),
+                     now_ns() < __atomic_load_n(&shed_until, __ATOMIC_RELAXED),
+                     __atomic_load_n(&qos_cmds[QOS_INTERACTIVE], __ATOMIC_RELAXED),
+                     __atomic_load_n(&qos_cmds[QOS_BATCH], __ATOMIC_RELAXED),
+                     __atomic_load_n(&idle_closed, __ATOMIC_RELAXED));
+        n += compress_stats(out + n, REPLY_MAX - n);
+        return n + snprintf(out + n, REPLY_MAX - n, "END\n");
+    } else if (sscanf(buf, "SET %255s %255[^\n]", key, value) == 2) {
+        kv_set(key, value);
+        return REPLY("OK\n");
+    } else if (sscanf(buf, "CAS %255s %" SCNu64 " %255[^\n]", key, &version, value) == 3) {
+        int rc = kv_cas(key, version, value, &version);
+        return format_cas(out, REPLY_MAX, rc, version);
+    } else if (sscanf(buf, "GET %255s %15s", key, opt) == 2 &&
+               strcmp(opt, "WITHVERSION") == 0) {
+        // GET key WITHVERSION -> "<version> <value>"
+        if ((version = kv_get(key, value, &blob)) == 0) return REPLY("NOT_FOUND\n");
+        if (blob) {
+            blob_unref(blob);
+            return REPLY("TOO_LARGE\n"); // use GETL
+        }
+        return snprintf(out, REPLY_MAX, "%" PRIu64 " %s\n", version, value);
+    } else if (sscanf(buf, "GET %255s", key) == 1) {
+        if (!kv_get(key, value, &blob)) return REPLY("NOT_FOUND\n");
+        if (blob) {
+            blob_unref(blob);
+            return REPLY("TOO_LARGE\n");
+        }
+        return snprintf(out, REPLY_MAX, "%s\n", value);
+    }
+    return REPLY("ERROR\n");
+}
+
+/* --------------------- Client Handler Threads --------------------- */
+/* SOCK_STREAM clients (Unix socket or TCP): '\n'-framed lines, plus the streamed
+ * SETL/GETL commands. */
 void *client_handler(void *arg) {
     int client_fd = *(int *)arg;
     free(arg);
 
-    char buf[BUF_SIZE];
+    char buf[BUF_SIZE], *reply;
     ssize_t n;
+    session ss = { .in_multi = 0 };
+    slow_req timing;
+    conn *c = calloc(1, sizeof(conn));
+    if (!c) {
+        close(client_fd);
+        client_gone();
+        return NULL;
+    }
+    c->fd = client_fd;
+    c->spin_ns = busy_poll_ns;
+    zc_enable(c);
 
-    while ((n = read(client_fd, buf, sizeof(buf) - 1)) > 0) {
-        buf[n] = '\0';
+    while ((n = conn_read_line(c, buf)) != -1) {
         char key[BUF_SIZE], value[BUF_SIZE];
+        size_t len;
+        kv_blob *blob;
 
-        if (sscanf(buf, "SET %s %[^\n]", key, value) == 2) {
-            kv_set(key, value);
-            write(client_fd, "OK\n", 3);
-        } else if (sscanf(buf, "GET %s", key) == 1) {
-            const char *val = kv_get(key);
-            if (val)
-                dprintf(client_fd, "%s\n", val);
-            else
-                write(client_fd, "NOT_FOUND\n", 10);
+        if (!(reply = conn_reply_buf(c))) break;
+        if (n != -2) slow_begin(&timing);
+        if (n == -2) {
+            len = REPLY_FIXED(reply, "ERROR\n");
+        } else if (sscanf(buf, "SETL %255s %zu", key, &len) == 2) {
+            // SETL key len, then len raw bytes
+            if (len > MAX_LARGE) {
+                conn_reply(c, REPLY_FIXED(reply, "ERROR\n"));
+                conn_flush(c);
+                break; // the payload would be parsed as commands: hang up
+            }
+            if (ss.in_multi) {
+                // cannot be queued; drop the payload so it is not run as commands
+                if (conn_skip_bytes(c, len) < 0) break;
+                ss.multi_failed = 1;
+                len = REPLY_FIXED(reply, "ERROR\n");
+            } else {
+                if (!(blob = blob_new(len)) || conn_read_blob(c, blob) < 0) {
+                    if (blob) blob_unref(blob);
+                    break;
+                }
+                slow_begin(&timing); // how fast the payload came is up to the client
+                if (admit(ss.qos, 1) < 0) {
+                    blob_unref(blob);
+                    len = REPLY_FIXED(reply, "BUSY\n");
+                } else {
+                    len = kv_set_blob(key, blob) ? REPLY_FIXED(reply, "OK\n") : REPLY_FIXED(reply, "ERROR\n");
+                    admit_done();
+                }
+            }
+        } else if (admit(ss.qos, command_cost(&ss, buf)) < 0) {
+            len = REPLY_FIXED(reply, "BUSY\n");
+        } else if (!ss.in_multi && sscanf(buf, "GETL %255s", key) == 1) {
+            // GETL key -> "$<len>\n" and the raw bytes (any value)
+            uint64_t found = kv_get(key, value, &blob);
+            admit_done(); // a slow reader must not hold a slot while streaming
+            if (!found) {
+                len = REPLY_FIXED(reply, "NOT_FOUND\n");
+            } else if (blob) {
+                slow_stamp(SLOW_EXEC);
+                int rc = conn_flush(c) < 0 ? -1 : stream_blob(c, blob); // in order
+                blob_unref(blob); // the store may have replaced it meanwhile
+                if (rc < 0) break;
+                slow_end(buf);
+                continue;
+            } else {
+                len = snprintf(reply, REPLY_MAX, "$%zu\n%s", strlen(value), value);
+            }
         } else {
-            write(client_fd, "ERROR\n", 6);
+            len = run_command(&ss, buf, reply);
+            admit_done();
+        }
+        conn_reply(c, len);
+        if (c->out_len >= output_soft) {
+            // behind: take no more commands until the client has read these
+            __atomic_add_fetch(&out_throttled, 1, __ATOMIC_RELAXED);
+            slow_stamp(SLOW_EXEC);
+            if (conn_flush(c) < 0) break;
         }
+        slow_end(buf);
     }
 
+    slow_cur = NULL; // a command cut short is not logged
+    if (n == -1) conn_flush(c); // the client may only have shut down its side
+    conn_drop(c);
+    iobuf_put(c->in);
+    zc_close(c);
+    // The reaper's dup keeps the socket open. A client that hung up gets our FIN
+    // now, not when the reaper is done; a dropped one (or an error) gets a reset,
+    // so the kernel lets go of the holds instead of waiting for it to read.
+    if (c->zc_orphaned && n == -1) shutdown(client_fd, SHUT_WR);
+    else if (c->zc_orphaned) tcp_reset(client_fd);
+    free(c);
     close(client_fd);
+    client_gone();
+    return NULL;
+}
+
+/* sendmmsg until msgs[0..cnt) are all out, waiting for a slow client as
+ * output_wait allows. Returns 0, or -1 on error or if the client is dropped. */
+static int send_replies(int fd, struct mmsghdr *msgs, int cnt) {
+    for (int sent = 0; sent < cnt; ) {
+        int m = sendmmsg(fd, msgs + sent, cnt - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (m < 0 && errno == EINTR) continue;
+        if (m < 0 && errno == EAGAIN) {
+            ssize_t queued = 0;
+            for (int i = sent; i < cnt; i++) queued += msgs[i].msg_hdr.msg_iov->iov_len;
+            if (output_wait(fd, queued) < 0) return -1;
+            continue;
+        }
+        if (m <= 0) return -1;
+        sent += m;
+    }
+    return 0;
+}
+
+/* SOCK_SEQPACKET clients: every message is one command and every reply one
+ * message, so there is no framing to do. Whatever has queued up is taken with one
+ * recvmmsg into a pooled buffer and answered with sendmmsg, the replies packed
+ * into a second one (sent early if it fills up). */
+void *seqpacket_handler(void *arg) {
+    int client_fd = *(int *)arg;
+    free(arg);
+
+    session ss = { .in_multi = 0 };
+    slow_req timing;
+    char *in = NULL, *out = NULL; // pooled: SEQ_BATCH commands of BUF_SIZE, packed replies
+    struct mmsghdr msgs[SEQ_BATCH];
+    struct iovec iov[SEQ_BATCH];
+    long spin_ns = busy_poll_ns;
+
+    for (;;) {
+        if (!in && !(in = iobuf_get())) break;
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < SEQ_BATCH; i++) {
+            iov[i].iov_base = in + i * BUF_SIZE;
+            iov[i].iov_len = BUF_SIZE - 1;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = recvmmsg(client_fd, msgs, SEQ_BATCH, MSG_DONTWAIT, NULL);
+        if (n < 0 && errno == EAGAIN) {
+            if (!wait_input(client_fd, &in, &spin_ns)) break;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || msgs[0].msg_len == 0) break; // error or peer closed
+        if (!(out = iobuf_get())) break;
+
+        // msgs[first..i) hold replies not sent yet, packed into out[0..used)
+        int i, first = 0, failed = 0;
+        size_t used = 0;
+        for (i = 0; i < n && msgs[i].msg_len > 0 && !failed; i++) {
+            char *cmd = in + i * BUF_SIZE, *reply = out + used;
+            size_t len = msgs[i].msg_len;
+            if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                len = REPLY_FIXED(reply, "ERROR\n");
+            } else {
+                cmd[len] = '\0';
+                cmd[strcspn(cmd, "\r\n")] = '\0';
+                slow_begin(&timing);
+                if (admit(ss.qos, command_cost(&ss, cmd)) < 0) {
+                    len = REPLY_FIXED(reply, "BUSY\n");
+                } else {
+                    len = run_command(&ss, cmd, reply);
+                    admit_done();
+                }
+                slow_end(cmd);
+            }
+            iov[i].iov_base = reply;
+            iov[i].iov_len = len;
+            memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            used += len;
+            if (IOBUF_SIZE - used < REPLY_MAX || i + 1 == n) {
+                failed = send_replies(client_fd, msgs + first, i + 1 - first) < 0;
+                first = i + 1;
+                used = 0;
+            }
+        }
+        if (!failed && first < i) failed = send_replies(client_fd, msgs + first, i - first) < 0;
+        iobuf_put(out);
+        out = NULL;
+        if (failed || i < n) break; // send failed, or the peer closed after its last command
+    }
+
+    iobuf_put(in);
+    iobuf_put(out);
+    close(client_fd);
+    client_gone();
     return NULL;
 }
 
 /* --------------------- Main Server --------------------- */
-int main(void) {
-    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+static int listen_unix(const char *path, int type) {
+    int listen_fd = socket(AF_UNIX, type, 0);
     if (listen_fd == -1) die("socket");
 
     struct sockaddr_un addr;
     memset(&addr, 0, sizeof(addr));
     addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, SOCKET_PATH, sizeof(addr.sun_path) - 1);
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
 
-    unlink(SOCKET_PATH);
+    unlink(path);
 
     if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) die("bind");
     if (listen(listen_fd, BACKLOG) == -1) die("listen");
 
-    printf("Multi-client KV Store server listening on %s\n", SOCKET_PATH);
+    printf("Multi-client KV Store server listening on %s%s\n", path,
+           type == SOCK_SEQPACKET ? " (seqpacket)" : "");
+    return listen_fd;
+}
+
+/* --tcp=[addr:]port; addr defaults to 127.0.0.1. */
+static int listen_tcp(const char *spec) {
+    char host[64] = "127.0.0.1";
+    const char *colon = strrchr(spec, ':');
+    if (colon) snprintf(host, sizeof(host), "%.*s", (int)(colon - spec), spec);
+    int port = atoi(colon ? colon + 1 : spec);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (port <= 0 || port > 65535 || inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "bad --tcp address: %s\n", spec);
+        exit(EXIT_FAILURE);
+    }
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd == -1) die("socket");
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) die("bind");
+    if (listen(listen_fd, BACKLOG) == -1) die("listen");
+
+    printf("Multi-client KV Store server listening on %s:%d\n", host, port);
+    return listen_fd;
+}
+
+/* One detached handler thread per accepted client, or a coroutine on a reactor. */
+static void *accept_loop(void *arg) {
+    int listen_fd = (int)(intptr_t)arg;
+    struct sockaddr_storage ss;
+    socklen_t sslen = sizeof(ss);
+    getsockname(listen_fd, (struct sockaddr *)&ss, &sslen);
+    int tcp = ss.ss_family == AF_INET;
+    int type = SOCK_STREAM;
+    socklen_t tlen = sizeof(type);
+    getsockopt(listen_fd, SOL_SOCKET, SO_TYPE, &type, &tlen);
+    void *(*handler)(void *) = type == SOCK_SEQPACKET ? seqpacket_handler : client_handler;
 
     while (1) {
         int *client_fd = malloc(sizeof(int));
@@ -118,14 +2344,103 @@ int main(void) {
             if (errno == EINTR) continue;
             die("accept");
         }
+        if (admit_client() < 0) {
+            send(*client_fd, "BUSY\n", 5, MSG_NOSIGNAL | MSG_DONTWAIT);
+            close(*client_fd);
+            free(client_fd);
+            continue;
+        }
+        if (tcp) {
+            int one = 1; // replies are small writes: no Nagle delay
+            setsockopt(*client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            set_keepalive(*client_fd);
+        }
+
+        if (nreactors) {
+            reactor_handoff(*client_fd, handler);
+            free(client_fd);
+            continue;
+        }
 
         pthread_t tid;
-        pthread_create(&tid, NULL, client_handler, client_fd);
+        pthread_create(&tid, NULL, handler, client_fd);
+        pin_thread(tid);
         pthread_detach(tid); // No need to join, resources freed automatically
     }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    static const struct option opts[] = {
+        { "tcp",       required_argument, NULL, 't' },
+        { "seqpacket", no_argument,       NULL, 's' },
+        { "busy-poll", required_argument, NULL, 'b' },
+        { "cpus",      required_argument, NULL, 'c' },
+        { "reactors",  required_argument, NULL, 'r' },
+        { "output-limit", required_argument, NULL, 'o' },
+        { "max-clients",  required_argument, NULL, 'm' },
+        { "max-inflight", required_argument, NULL, 'i' },
+        { "idle-timeout", required_argument, NULL, 'I' },
+        { "keepalive",    required_argument, NULL, 'k' },
+        { "slowlog",      required_argument, NULL, 'l' },
+        { "compress-min", required_argument, NULL, 'z' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char *tcp = NULL;
+    int seqpacket = 0, nreact = 0;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+        if (opt == 't') {
+            tcp = optarg;
+        } else if (opt == 's') {
+            seqpacket = 1;
+        } else if (opt == 'b' && atol(optarg) >= 0 && atol(optarg) <= MAX_BUSY_POLL_US) {
+            busy_poll_ns = atol(optarg) * 1000;
+        } else if (opt == 'c' && parse_cpus(optarg) == 0) {
+            continue;
+        } else if (opt == 'r' && (nreact = atoi(optarg)) > 0 && nreact <= MAX_REACTORS) {
+            continue;
+        } else if (opt == 'o' && parse_output_limit(optarg) == 0) {
+            continue;
+        } else if (opt == 'm' && (max_clients = atoi(optarg)) > 0) {
+            continue;
+        } else if (opt == 'i' && (max_inflight = atoi(optarg)) > 0) {
+            continue;
+        } else if (opt == 'I' && (idle_secs = atoi(optarg)) >= 0 && idle_secs <= INT_MAX / 1000) {
+            continue;
+        } else if (opt == 'k' && (keepalive_secs = atoi(optarg)) >= 0) {
+            continue;
+        } else if (opt == 'l' && (slowlog_us = atol(optarg)) >= -1) {
+            continue;
+        } else if (opt == 'z' && atol(optarg) >= 0) {
+            compress_min = atol(optarg);
+        } else {
+            fprintf(stderr, "usage: %s [--tcp=[addr:]port] [--seqpacket] [--busy-poll=USEC] [--cpus=LIST]"
+                    " [--reactors=N] [--output-limit=SOFT,HARD,SECS] [--max-clients=N]"
+                    " [--max-inflight=N] [--idle-timeout=SECS] [--keepalive=SECS]"
+                    " [--slowlog=USEC] [--compress-min=BYTES]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    init_shared_ints();
+    slowlog_init();
+    if (nreact) start_reactors(nreact);
+
+    int listen_fd = listen_unix(SOCKET_PATH, SOCK_STREAM);
+    pthread_t tid;
+    if (tcp) {
+        pthread_create(&tid, NULL, accept_loop, (void *)(intptr_t)listen_tcp(tcp));
+        pthread_detach(tid);
+    }
+    if (seqpacket) {
+        int seq_fd = listen_unix(SEQ_SOCKET_PATH, SOCK_SEQPACKET);
+        pthread_create(&tid, NULL, accept_loop, (void *)(intptr_t)seq_fd);
+        pthread_detach(tid);
+    }
+    accept_loop((void *)(intptr_t)listen_fd);
 
     close(listen_fd);
     unlink(SOCKET_PATH);
     return 0;
 }
-
@@ -1,9 +1,25 @@
 // kvstore_txn.c
 // Compile: gcc -O2 -pthread kvstore_txn.c -o kvstore_txn
-// Run: ./kvstore_txn
+//          (add -DKV_LZ4 ... -llz4 to compress large values)
+// Run: ./kvstore_txn [--compress-min=BYTES] [--dict=FILE] [bench]
 //
 // Simple in-memory key-value store with transactions, per-key exclusive locks,
-// wait-for graph based deadlock detection and victim selection (youngest txn).
+// wait-for graph based deadlock detection and cost-based victim selection.
+// Transactions that know their key set up front can use txn_run(), which takes
+// all locks in canonical order and never needs deadlock detection, or det_submit(),
+// which batches them into epochs executed in a deterministic order (no aborts).
+// Read-only transactions (txn_begin_ro) take no locks: they validate per-key commit
+// versions against the snapshot taken at begin instead. txn_add() buffers a counter
+// delta under a shared increment lock, so concurrent increments never conflict.
+// Lock waits and whole transactions can be bounded by timeouts (TXN_TIMEOUT), all
+// enforced by one timer thread on the monotonic clock.
+// Large values and flushed tables are freed by a background reclaimer thread, and
+// a defrag thread relocates live values when the heap gets fragmented (glibc).
+// With KV_LZ4, values above a size threshold are kept LZ4-compressed (optionally
+// against a dictionary) and decompressed on read.
+//
+// Bench: ./kvstore_txn bench   (2PL + retry vs deterministic epochs, hot keys;
+//                              2PL + retry over Zipf-skewed keys)
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,16 +29,62 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <time.h>
+#include <malloc.h>
+#include <getopt.h>
+#ifdef KV_LZ4
+#include <lz4.h>
+#endif
 
 #define MAX_KEYS 128
 #define MAX_TXNS 32
 #define KEYLEN 64
 #define MAX_WRITES 64
+#define LOCK_PARTITIONS 16  // lock table partitions, each with its own latch
+#define PART_BUCKETS 64     // hash chains per partition
+#define RO_ATTEMPTS 3   // lock-free tries of txn_run_ro before it falls back to 2PL
+
+/* victim cost weights: the cheapest txn in a cycle is aborted */
+#define COST_PER_LOCK 4
+#define COST_PER_WRITE 2
+#define COST_PER_RETRY 16
+
+/* a waiter holding no locks lets waiters that do hold some go first, at most this
+   many times per lock wait */
+#define HOT_YIELD_MAX 4
+
+/* txn_retry backoff bounds (microseconds) */
+#define BACKOFF_BASE_US 1000
+#define BACKOFF_MAX_US 200000
+
+/* deterministic (epoch) mode */
+#define DET_EPOCH_MAX 256   // txns per epoch
+#define DET_EPOCH_US 1000   // epoch length
+#define DET_WORKERS 4
+#define LAZYFREE_MIN 65536  // values this big (bytes) are freed in the background
+#define LAZYFREE_QUEUE 1024 // pending jobs; when full, frees happen inline
+#define DEFRAG_CHECK_MS 100      // how often the defragger samples fragmentation
+#define DEFRAG_RATIO 1.4         // start a pass above this rss / allocated ratio
+#define DEFRAG_MIN_WASTE (8 << 20) // ...and only if at least this much is wasted
+#define DEFRAG_SLICE_US 1000     // CPU budget: work at most this long per slice,
+#define DEFRAG_DUTY 10           // then sleep DEFRAG_DUTY times as long
+#define DEFRAG_GAP_MS 1000       // at least this long between two passes,
+#define DEFRAG_MAX_GAP_MS 60000  // doubled up to this while passes do not help
+#define COMPRESS_MIN 1024   // default --compress-min: smaller values stay raw
+#define DICT_MAX 65536      // LZ4 uses at most the last 64KB of a dictionary
+
+/* transactional calls return 0 or one of these */
+#define TXN_ABORTED -1  // deadlock victim, explicit abort or misuse
+#define TXN_TIMEOUT -2  // lock wait timeout or txn deadline exceeded
 
 /* ---------- KV store (simple array buckets) ---------- */
 typedef struct KVItem {
     char key[KEYLEN];
-    char *value;
+    char *value;          // NULL for integer-encoded values
+    size_t vlen;          // strlen of the (uncompressed) value
+    uint32_t clen;        // 0, or value holds clen bytes of LZ4 output
+    bool is_int;          // value is ival (canonical decimal int64), no heap copy
+    int64_t ival;
+    uint64_t version;     // commit that last wrote this item
     struct KVItem *next;
 } KVItem;
 
@@ -32,30 +94,72 @@ typedef struct {
 } KVStore;
 
 /* ---------- Per-key lock ---------- */
-typedef struct {
-    int holder; // txn id or -1
-    pthread_mutex_t mtx;
-    pthread_cond_t cond;
+/* Two modes: exclusive (one holder) and increment (any number of holders, as
+   txn_add deltas commute). X conflicts with both; INC only with X. */
+typedef enum { LOCK_X, LOCK_INC } LockMode;
+
+typedef struct LockPartition LockPartition;
+
+typedef struct KeyLock {
+    char key[KEYLEN];
+    int holder;           // txn id holding X or -1
+    uint32_t inc_mask;    // bit per txn id holding INC
+    pthread_cond_t cond;  // waited on with part->latch
+    LockPartition *part;
+    struct KeyLock *next; // hash chain within the partition
+    uint32_t waiters;     // txns blocked on this lock right now
+    uint32_t pins;        // timer thread wakeups in flight (atomic)
+    uint32_t busy_waiters; // waiters that already hold other locks
 } KeyLock;
 
+/* Lock table: one entry per key, created on first use and freed once nobody holds,
+   waits on or is about to wake it; spread over cache-aligned partitions so
+   unrelated keys never share a latch line. */
+struct LockPartition {
+    pthread_mutex_t latch; // protects the chains and every KeyLock in them
+    KeyLock *buckets[PART_BUCKETS];
+} __attribute__((aligned(64)));
+
 /* ---------- Transaction ---------- */
+typedef struct DetTxn DetTxn;
+
 typedef struct {
     int id;               // 0..MAX_TXNS-1
-    uint64_t start_seq;   // increasing sequence for victim selection
+    uint64_t start_seq;   // increasing sequence, kept across retries (tie-break)
+    int retries;          // how many times this unit of work was aborted before
     volatile bool aborted;
-    KeyLock *held_locks[MAX_KEYS];
-    int held_count;
+    bool declared;        // one-shot txn: all locks taken up front by txn_run
+    DetTxn *det;          // deterministic txn: access checked against its lock set
+    bool read_only;       // no locks, reads validated against snapshot
+    uint64_t snapshot;    // read-only: last commit visible to this txn
+    KeyLock **held_locks; // each lock once; "already held" is checked on the lock
+    int held_count, held_cap;
+    volatile bool has_waiters; // someone recorded a wait-for edge to us (under wf_mtx)
+    int abort_rc;         // why aborted became true (TXN_ABORTED / TXN_TIMEOUT)
+    // timeouts, all under timer_mtx (times are CLOCK_MONOTONIC ns, 0 = none)
+    unsigned lock_timeout_ms;  // max time per lock wait
+    uint64_t deadline_ns;      // whole txn must finish by then
+    uint64_t wait_until_ns;    // current lock wait gives up then
+    bool wake_pending;         // aborted by someone else, must be woken
+    KeyLock *waiting_on;       // lock we are blocked on, if any
+    int heap_idx;              // position in timer_heap or -1
     // local write set (applied at commit)
     struct {
         char key[KEYLEN];
         char *value;
     } write_set[MAX_WRITES];
     int write_cnt;
+    // local counter deltas (merged into the stored value at commit)
+    struct {
+        char key[KEYLEN];
+        long long delta;
+    } add_set[MAX_WRITES];
+    int add_cnt;
 } Transaction;
 
 /* ---------- Globals ---------- */
 static KVStore gkv;
-static KeyLock glocks[MAX_KEYS];
+static LockPartition lock_parts[LOCK_PARTITIONS];
 
 static Transaction *txns[MAX_TXNS]; // slot -> Transaction*
 static uint64_t seq_counter = 0;
@@ -65,77 +169,767 @@ static pthread_mutex_t txn_mtx = PTHREAD_MUTEX_INITIALIZER;
 /* wait-for graph: wait_for[a][b] == true means txn a waits for txn b */
 static bool wait_for[MAX_TXNS][MAX_TXNS];
 static pthread_mutex_t wf_mtx = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long deadlock_victims = 0; // under wf_mtx
+
+/* central timer: min-heap of txns by next expiry, served by timer_thread */
+static Transaction *timer_heap[MAX_TXNS];
+static int timer_heap_len = 0;
+static pthread_mutex_t timer_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timer_cond;
+static unsigned default_lock_timeout_ms = 0; // applied by txn_begin, 0 = wait forever
+static unsigned default_deadline_ms = 0;
+
+/* 2PL / epoch exclusion: deterministic txns take no KeyLocks, so an epoch runs
+   only once no 2PL txn is open, and 2PL txns do not start while it runs */
+static pthread_mutex_t gate_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gate_cond = PTHREAD_COND_INITIALIZER;
+static int gate_2pl = 0;        // open 2PL txns
+static bool gate_epoch = false; // an epoch runs or waits for 2PL txns to finish
+
+/* commits apply one at a time; commit_seq is published only once a commit is fully
+   applied, so every commit <= commit_seq is complete */
+static uint64_t commit_seq = 0;
+static pthread_mutex_t commit_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* lazy free: ring of pending jobs drained by lazyfree_thread */
+typedef struct {
+    void *p;
+    bool table;           // p is a detached KVItem *[MAX_KEYS] (kv_flush)
+} LazyJob;
+static LazyJob lazy_ring[LAZYFREE_QUEUE];
+static unsigned lazy_head = 0, lazy_len = 0;
+static pthread_mutex_t lazy_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lazy_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t lazy_once = PTHREAD_ONCE_INIT;
+static bool lazyfree_on = true;
+static unsigned long lazy_deferred = 0; // jobs handed to the reclaimer, under lazy_mtx
+
+/* active defrag (defrag_thread works on gkv) */
+static pthread_once_t defrag_once = PTHREAD_ONCE_INIT;
+static bool defrag_on = true;
+static unsigned long defrag_passes = 0, defrag_moved = 0; // updated by defrag_thread only
+static unsigned long defrag_futile = 0; // passes that did not lower the ratio
+
+/* value compression (KV_LZ4 builds); stats are updated with atomics */
+static size_t compress_min = COMPRESS_MIN; // 0 = off
+#ifdef KV_LZ4
+static struct {
+    unsigned long packed, skipped, unpacked; // values compressed / not worth it / read back
+    uint64_t raw_bytes, packed_bytes;        // of the values that were kept compressed
+    uint64_t pack_ns, unpack_ns;
+} lz4_stats;
+#endif
+
+/* ---------- Deterministic txn (one entry of an epoch) ---------- */
+struct DetTxn {
+    int (*fn)(Transaction *t, void *arg);
+    void *arg;
+    unsigned locks[MAX_KEYS]; // sorted, deduplicated lock indices
+    bool write[MAX_KEYS];     // lock mode per entry
+    int nlocks;
+    int pending;              // unfinished predecessors in this epoch
+    int *succ;                // txns (epoch positions) waiting for us
+    int nsucc, capsucc;
+    int rc;
+    bool done;
+};
 
 /* ---------- Utilities ---------- */
-static unsigned hash_key(const char *k){
+static uint32_t hash32(const char *k){
     uint32_t h = 2166136261u;
     const unsigned char *p = (const unsigned char*)k;
     while(*p){
         h ^= *p++;
         h *= 16777619u;
     }
-    return h % MAX_KEYS;
+    return h;
+}
+
+static unsigned hash_key(const char *k){
+    return hash32(k) % MAX_KEYS;
+}
+
+/* s as an int64, only if printing it back gives exactly s (so "007", "-0" and
+   "+1" stay strings). */
+static bool parse_int(const char *s, int64_t *out){
+    const char *p = s;
+    bool neg = *p == '-';
+    if(neg) p++;
+    if(*p < '0' || *p > '9' || (*p == '0' && (p[1] != '\0' || neg))) return false;
+    uint64_t v = 0, lim = neg ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+    for(; *p; p++){
+        if(*p < '0' || *p > '9') return false;
+        unsigned d = *p - '0';
+        if(v > (lim - d) / 10) return false;
+        v = v * 10 + d;
+    }
+    *out = neg ? (int64_t)(0 - v) : (int64_t)v;
+    return true;
+}
+
+/* v in decimal into out (21 bytes), two digits per division. Returns the length. */
+static size_t format_int(int64_t v, char *out){
+    static const char pairs[201] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char tmp[21], *p = tmp + sizeof(tmp);
+    uint64_t u = v < 0 ? 0 - (uint64_t)v : (uint64_t)v;
+    while(u >= 100){
+        p -= 2;
+        memcpy(p, pairs + (u % 100) * 2, 2);
+        u /= 100;
+    }
+    if(u >= 10){ p -= 2; memcpy(p, pairs + u * 2, 2); }
+    else *--p = '0' + u;
+    if(v < 0) *--p = '-';
+    size_t len = tmp + sizeof(tmp) - p;
+    memcpy(out, p, len);
+    out[len] = '\0';
+    return len;
+}
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* ---------- Lazy free ---------- */
+/* Freeing a multi-megabyte value (or a whole table) costs page-table work in
+   munmap/madvise; done on the write path it stalls everyone behind s->mtx and
+   commit_mtx. Callers detach the memory under their locks and hand it here after
+   dropping them; small values are still freed on the spot. */
+static void lazy_free_table(KVItem **buckets){
+    for(int i=0;i<MAX_KEYS;i++){
+        KVItem *it = buckets[i];
+        while(it){
+            KVItem *next = it->next;
+            free(it->value);
+            free(it);
+            it = next;
+        }
+    }
+    free(buckets);
+}
+
+static void *lazyfree_thread(void *arg){
+    (void)arg;
+    pthread_mutex_lock(&lazy_mtx);
+    for(;;){
+        while(lazy_len == 0) pthread_cond_wait(&lazy_cond, &lazy_mtx);
+        LazyJob j = lazy_ring[lazy_head];
+        lazy_head = (lazy_head + 1) % LAZYFREE_QUEUE;
+        lazy_len--;
+        pthread_mutex_unlock(&lazy_mtx);
+        if(j.table) lazy_free_table(j.p);
+        else free(j.p);
+        pthread_mutex_lock(&lazy_mtx);
+    }
+    return NULL;
+}
+
+static void lazyfree_start(void){
+    pthread_t tid;
+    pthread_create(&tid, NULL, lazyfree_thread, NULL);
+    pthread_detach(tid);
+}
+
+/* Queue a job; false if the ring is full (caller frees inline). */
+static bool lazy_push(void *p, bool table){
+    pthread_mutex_lock(&lazy_mtx);
+    if(lazy_len == LAZYFREE_QUEUE){
+        pthread_mutex_unlock(&lazy_mtx);
+        return false;
+    }
+    lazy_ring[(lazy_head + lazy_len) % LAZYFREE_QUEUE] = (LazyJob){ p, table };
+    lazy_len++;
+    lazy_deferred++;
+    pthread_cond_signal(&lazy_cond);
+    pthread_mutex_unlock(&lazy_mtx);
+    return true;
+}
+
+/* Free a value of len bytes, in the background if it is big. Call without locks. */
+static void lazy_free(char *p, size_t len){
+    if(p == NULL) return;
+    if(!lazyfree_on || len < LAZYFREE_MIN || !lazy_push(p, false)) free(p);
+}
+
+/* ---------- Active defrag ---------- */
+/* Churn on variable-size values leaves live items and values scattered over
+   mostly-free heap pages that glibc cannot give back. A pass re-allocates every
+   live block while still holding on to the old copies, so the allocator packs the
+   copies densely into existing free space instead of handing the old spots right
+   back; the old copies of a slice are freed together when the slice ends, so a pass
+   never needs more than one slice's worth of extra memory, and once the pass is
+   done malloc_trim() returns the pages left empty to the kernel. Values past the
+   mmap threshold live in their own mappings and are skipped. */
+typedef struct {
+    size_t rss;          // resident bytes
+    size_t allocated;    // bytes in live malloc chunks (heap + mmapped)
+    double ratio;        // rss / allocated
+} FragInfo;
+
+static FragInfo frag_info(void){
+    FragInfo f = {0};
+    struct mallinfo2 mi = mallinfo2();
+    f.allocated = mi.uordblks + mi.hblkhd;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    unsigned long size, resident;
+    if(fp && fscanf(fp, "%lu %lu", &size, &resident) == 2) f.rss = resident * (size_t)sysconf(_SC_PAGESIZE);
+    if(fp) fclose(fp);
+    f.ratio = f.allocated ? (double)f.rss / f.allocated : 1.0;
+    return f;
+}
+
+/* Old copies waiting for the end of the slice, chained through their first word
+   (values shorter than a pointer stay put). Only the defrag thread touches it. */
+static void *defrag_garbage = NULL;
+
+/* Copy size bytes at p into a fresh allocation; returns the block to keep. */
+static void *defrag_move(void *p, size_t size, unsigned *moved){
+    void *n = malloc(size);
+    if(n == NULL) return p;
+    memcpy(n, p, size);
+    *(void**)p = defrag_garbage;
+    defrag_garbage = p;
+    (*moved)++;
+    return n;
+}
+
+static void defrag_free_garbage(void){
+    while(defrag_garbage){
+        void *next = *(void**)defrag_garbage;
+        free(defrag_garbage);
+        defrag_garbage = next;
+    }
 }
 
+/* Relocate the items of bucket idx and their values; returns how many blocks
+   moved. Items pin pages as much as values do, so they move too. */
+static unsigned defrag_bucket(KVStore *s, unsigned idx){
+    unsigned moved = 0;
+    pthread_mutex_lock(&s->mtx);
+    for(KVItem **pp = &s->buckets[idx]; *pp; pp = &(*pp)->next){
+        *pp = defrag_move(*pp, sizeof(KVItem), &moved);
+        KVItem *it = *pp;
+        size_t size = it->clen ? it->clen : it->vlen + 1;
+        if(it->value && size >= sizeof(void*) && size < LAZYFREE_MIN)
+            it->value = defrag_move(it->value, size, &moved);
+    }
+    pthread_mutex_unlock(&s->mtx);
+    return moved;
+}
+
+/* One defrag pass over s, in slices of DEFRAG_SLICE_US separated by sleeps so the
+   defragger never takes more than ~1/(DEFRAG_DUTY+1) of a CPU. */
+static unsigned long kv_defrag(KVStore *s){
+    unsigned long moved = 0;
+    unsigned idx = 0;
+    while(idx < MAX_KEYS){
+        uint64_t slice_end = now_ns() + DEFRAG_SLICE_US * 1000ull;
+        while(idx < MAX_KEYS && now_ns() < slice_end) moved += defrag_bucket(s, idx++);
+        defrag_free_garbage();
+        if(idx < MAX_KEYS) usleep(DEFRAG_SLICE_US * DEFRAG_DUTY);
+    }
+    malloc_trim(0);
+    return moved;
+}
+
+/* Passes are at least DEFRAG_GAP_MS apart. A pass that leaves the ratio where it
+   was (waste the allocator will not give back) doubles the gap, so a heap that
+   cannot be compacted is not rescanned every check; a pass that helps resets it. */
+static void *defrag_thread(void *arg){
+    KVStore *s = arg;
+    unsigned gap_ms = DEFRAG_GAP_MS;
+    uint64_t next_ns = 0; // no pass before then
+    for(;;){
+        usleep(DEFRAG_CHECK_MS * 1000);
+        if(!defrag_on || now_ns() < next_ns) continue;
+        FragInfo before = frag_info();
+        if(before.ratio < DEFRAG_RATIO || before.rss < before.allocated + DEFRAG_MIN_WASTE) continue;
+        unsigned long moved = kv_defrag(s);
+        FragInfo after = frag_info();
+        if(after.ratio < before.ratio){
+            gap_ms = DEFRAG_GAP_MS;
+        } else {
+            __atomic_add_fetch(&defrag_futile, 1, __ATOMIC_RELAXED);
+            gap_ms = gap_ms * 2 > DEFRAG_MAX_GAP_MS ? DEFRAG_MAX_GAP_MS : gap_ms * 2;
+        }
+        next_ns = now_ns() + gap_ms * 1000000ull;
+        __atomic_add_fetch(&defrag_moved, moved, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&defrag_passes, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void defrag_start(void){
+    pthread_t tid;
+    pthread_create(&tid, NULL, defrag_thread, &gkv);
+    pthread_detach(tid);
+}
+
+/* ---------- Value compression ---------- */
+/* Values of at least compress_min bytes are LZ4-compressed outside the store lock
+   on write, and kept that way only if it saves an eighth or more. Reads copy the
+   compressed bytes out under the lock and decompress after dropping it. With a
+   dictionary (--dict) every value is compressed as if it followed the dictionary,
+   which is what makes small similar JSON blobs compress at all. */
+#ifdef KV_LZ4
+static char lz4_dict[DICT_MAX];
+static int lz4_dict_len = 0;
+static LZ4_stream_t lz4_dict_stream; // dictionary loaded; cloned per value
+
+/* Load the last DICT_MAX bytes of path as the compression dictionary. */
+static int lz4_load_dict(const char *path){
+    FILE *fp = fopen(path, "rb");
+    if(!fp) return -1;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, size > DICT_MAX ? size - DICT_MAX : 0, SEEK_SET);
+    lz4_dict_len = (int)fread(lz4_dict, 1, DICT_MAX, fp);
+    fclose(fp);
+    LZ4_initStream(&lz4_dict_stream, sizeof(lz4_dict_stream));
+    LZ4_loadDict(&lz4_dict_stream, lz4_dict, lz4_dict_len);
+    return 0;
+}
+
+/* Compressed copy of value (len bytes), or NULL if it is too small or does not
+   shrink enough; *clen gets the compressed size. */
+static char *lz4_pack(const char *value, size_t len, uint32_t *clen){
+    if(compress_min == 0 || len < compress_min || len > LZ4_MAX_INPUT_SIZE) return NULL;
+    int cap = LZ4_compressBound((int)len);
+    char *dst = malloc(cap);
+    if(dst == NULL) return NULL;
+    uint64_t t0 = now_ns();
+    int n;
+    if(lz4_dict_len){
+        LZ4_stream_t st = lz4_dict_stream;
+        n = LZ4_compress_fast_continue(&st, value, dst, (int)len, cap, 1);
+    } else {
+        n = LZ4_compress_default(value, dst, (int)len, cap);
+    }
+    __atomic_add_fetch(&lz4_stats.pack_ns, now_ns() - t0, __ATOMIC_RELAXED);
+    if(n <= 0 || (size_t)n > len - len / 8){
+        __atomic_add_fetch(&lz4_stats.skipped, 1, __ATOMIC_RELAXED);
+        free(dst);
+        return NULL;
+    }
+    __atomic_add_fetch(&lz4_stats.packed, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&lz4_stats.raw_bytes, len, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&lz4_stats.packed_bytes, n, __ATOMIC_RELAXED);
+    *clen = (uint32_t)n;
+    char *shrunk = realloc(dst, n);
+    return shrunk ? shrunk : dst;
+}
+
+/* Decompress clen bytes into a fresh NUL-terminated string of vlen bytes; NULL if
+   the data is corrupt or we are out of memory. */
+static char *lz4_unpack(const char *src, uint32_t clen, size_t vlen){
+    char *out = malloc(vlen + 1);
+    if(out == NULL) return NULL;
+    uint64_t t0 = now_ns();
+    int n = lz4_dict_len
+          ? LZ4_decompress_safe_usingDict(src, out, (int)clen, (int)vlen, lz4_dict, lz4_dict_len)
+          : LZ4_decompress_safe(src, out, (int)clen, (int)vlen);
+    __atomic_add_fetch(&lz4_stats.unpack_ns, now_ns() - t0, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&lz4_stats.unpacked, 1, __ATOMIC_RELAXED);
+    if(n != (int)vlen){
+        free(out);
+        return NULL;
+    }
+    out[vlen] = '\0';
+    return out;
+}
+
+static void kv_compress_stats(void){
+    unsigned long packed = __atomic_load_n(&lz4_stats.packed, __ATOMIC_RELAXED);
+    unsigned long unpacked = __atomic_load_n(&lz4_stats.unpacked, __ATOMIC_RELAXED);
+    uint64_t raw = __atomic_load_n(&lz4_stats.raw_bytes, __ATOMIC_RELAXED);
+    uint64_t out = __atomic_load_n(&lz4_stats.packed_bytes, __ATOMIC_RELAXED);
+    printf("compression: %lu values packed (%lu not worth it), ratio %.2f, "
+           "%.0f ns/pack, %.0f ns/unpack\n",
+           packed, __atomic_load_n(&lz4_stats.skipped, __ATOMIC_RELAXED),
+           out ? (double)raw / out : 1.0,
+           packed ? (double)__atomic_load_n(&lz4_stats.pack_ns, __ATOMIC_RELAXED) / packed : 0.0,
+           unpacked ? (double)__atomic_load_n(&lz4_stats.unpack_ns, __ATOMIC_RELAXED) / unpacked : 0.0);
+}
+#else
+static int lz4_load_dict(const char *path){
+    fprintf(stderr, "%s: dictionaries need a KV_LZ4 build\n", path);
+    return -1;
+}
+static char *lz4_pack(const char *value, size_t len, uint32_t *clen){
+    (void)value; (void)len; (void)clen;
+    return NULL;
+}
+static char *lz4_unpack(const char *src, uint32_t clen, size_t vlen){
+    (void)src; (void)clen; (void)vlen;
+    return NULL;
+}
+#endif
+
 /* ---------- KV store functions ---------- */
 static void kv_init(KVStore *s){
     for(int i=0;i<MAX_KEYS;i++) s->buckets[i] = NULL;
     pthread_mutex_init(&s->mtx, NULL);
+    pthread_once(&lazy_once, lazyfree_start);
+    if(s == &gkv) pthread_once(&defrag_once, defrag_start);
 }
 
-static char *kv_read(KVStore *s, const char *key){
+/* Copy of key's value into *out (NULL if absent); *version gets the commit that
+   wrote it (0 if absent). Returns -1 if the stored value could not be read back
+   (compressed data that does not decompress, out of memory), 0 otherwise. */
+static int kv_read_at(KVStore *s, const char *key, char **out, uint64_t *version){
     unsigned idx = hash_key(key);
+    *out = NULL;
     pthread_mutex_lock(&s->mtx);
     KVItem *it = s->buckets[idx];
     while(it){
         if(strcmp(it->key, key) == 0){
-            char *val = it->value ? strdup(it->value) : NULL;
+            char *val = NULL;
+            bool has = true;
+            if(it->is_int){
+                char buf[21];
+                format_int(it->ival, buf);
+                val = strdup(buf);
+            } else if(it->clen){
+                // copy the (small) compressed form; decompress without the lock
+                uint32_t clen = it->clen;
+                size_t vlen = it->vlen;
+                char *packed = malloc(clen);
+                if(packed) memcpy(packed, it->value, clen);
+                if(version) *version = it->version;
+                pthread_mutex_unlock(&s->mtx);
+                val = packed ? lz4_unpack(packed, clen, vlen) : NULL;
+                free(packed);
+                if(!val) return -1;
+                *out = val;
+                return 0;
+            } else if(it->value) val = strdup(it->value);
+            else has = false;
+            if(version) *version = it->version;
             pthread_mutex_unlock(&s->mtx);
-            return val;
+            if(has && !val) return -1;
+            *out = val;
+            return 0;
         }
         it = it->next;
     }
     pthread_mutex_unlock(&s->mtx);
-    return NULL;
+    if(version) *version = 0;
+    return 0;
 }
 
-static void kv_write(KVStore *s, const char *key, const char *value){
+/* Copy of key's value; NULL if absent or unreadable. */
+static char *kv_read(KVStore *s, const char *key){
+    char *v;
+    return kv_read_at(s, key, &v, NULL) < 0 ? NULL : v;
+}
+
+/* Item for key in bucket idx, inserted (valueless) if absent. Caller holds s->mtx. */
+static KVItem *kv_item_locked(KVStore *s, unsigned idx, const char *key){
+    KVItem *it = s->buckets[idx];
+    while(it && strcmp(it->key, key) != 0) it = it->next;
+    if(it) return it;
+    it = calloc(1, sizeof(KVItem));
+    strncpy(it->key, key, KEYLEN-1);
+    it->next = s->buckets[idx];
+    s->buckets[idx] = it;
+    return it;
+}
+
+/* Store value under key, stamped with commit version. Caller holds commit_mtx.
+   Values that are canonical int64s are kept in the item itself. */
+static void kv_write_at(KVStore *s, const char *key, const char *value, uint64_t version){
     unsigned idx = hash_key(key);
+    int64_t ival = 0;
+    bool is_int = value && parse_int(value, &ival);
+    size_t len = value && !is_int ? strlen(value) : 0;
+    uint32_t clen = 0;
+    // copied (or compressed) before taking the lock
+    char *copy = value && !is_int ? lz4_pack(value, len, &clen) : NULL;
+    if(copy == NULL && value && !is_int){
+        copy = malloc(len + 1);
+        memcpy(copy, value, len + 1);
+    }
     pthread_mutex_lock(&s->mtx);
-    KVItem *it = s->buckets[idx];
-    while(it){
-        if(strcmp(it->key, key) == 0){
-            free(it->value);
-            it->value = value ? strdup(value) : NULL;
-            pthread_mutex_unlock(&s->mtx);
-            return;
+    KVItem *it = kv_item_locked(s, idx, key);
+    char *old = it->value;
+    size_t old_len = it->clen ? it->clen : it->vlen;
+    it->value = copy;
+    it->vlen = len;
+    it->clen = clen;
+    it->is_int = is_int;
+    it->ival = ival;
+    it->version = version;
+    pthread_mutex_unlock(&s->mtx);
+    lazy_free(old, old_len);
+}
+
+/* Add delta to the integer stored under key (absent or non-numeric counts as 0).
+   Caller holds commit_mtx. An integer-encoded counter is updated in place. */
+static void kv_add_at(KVStore *s, const char *key, long long delta, uint64_t version){
+    unsigned idx = hash_key(key);
+    pthread_mutex_lock(&s->mtx);
+    KVItem *it = kv_item_locked(s, idx, key);
+    // (a value big enough to be compressed is not a number anyway: counts as 0)
+    int64_t cur = it->is_int ? it->ival : it->value && !it->clen ? strtoll(it->value, NULL, 10) : 0;
+    char *old = it->value;
+    size_t old_len = it->clen ? it->clen : it->vlen;
+    it->value = NULL;
+    it->vlen = 0;
+    it->clen = 0;
+    it->is_int = true;
+    it->ival = (int64_t)((uint64_t)cur + (uint64_t)delta); // wraps instead of UB
+    it->version = version;
+    pthread_mutex_unlock(&s->mtx);
+    lazy_free(old, old_len);
+}
+
+/* Commit bracket: writes between begin/end share one version, which becomes
+   visible to read-only txns only at commit_end. */
+static uint64_t commit_begin(void){
+    pthread_mutex_lock(&commit_mtx);
+    return commit_seq + 1;
+}
+
+static void commit_end(uint64_t version){
+    __atomic_store_n(&commit_seq, version, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&commit_mtx);
+}
+
+/* Drop every key. The table is swapped out in O(MAX_KEYS) and freed by the
+   reclaimer. Non-transactional like kv_write: run it with no txns in flight. */
+static void kv_flush(KVStore *s){
+    KVItem **old = malloc(sizeof(s->buckets));
+    uint64_t version = commit_begin();
+    pthread_mutex_lock(&s->mtx);
+    memcpy(old, s->buckets, sizeof(s->buckets));
+    memset(s->buckets, 0, sizeof(s->buckets));
+    pthread_mutex_unlock(&s->mtx);
+    commit_end(version);
+    if(!lazyfree_on || !lazy_push(old, true)) lazy_free_table(old);
+}
+
+/* Non-transactional single-key write (seeding, resets). */
+static void kv_write(KVStore *s, const char *key, const char *value){
+    uint64_t version = commit_begin();
+    kv_write_at(s, key, value, version);
+    commit_end(version);
+}
+
+/* ---------- Central timer (lock wait timeouts, deadlines, wakeups) ---------- */
+/* Waiters block on their lock's condition without polling. The timer thread is
+   the only one that times them out, and it is also how a deadlock detector wakes
+   a victim sleeping on another partition's latch (taking that latch from inside
+   detection could deadlock). Lock order: latch -> wf_mtx -> timer_mtx; the timer
+   thread never holds timer_mtx and a latch together. */
+
+/* When the timer must next look at t (0 = never). */
+static uint64_t timer_key(const Transaction *t){
+    if(t->wake_pending) return 1;
+    uint64_t k = t->deadline_ns;
+    if(t->wait_until_ns && (k == 0 || t->wait_until_ns < k)) k = t->wait_until_ns;
+    return k;
+}
+
+static void heap_swap(int i, int j){
+    Transaction *a = timer_heap[i];
+    timer_heap[i] = timer_heap[j];
+    timer_heap[j] = a;
+    timer_heap[i]->heap_idx = i;
+    timer_heap[j]->heap_idx = j;
+}
+
+static void heap_fix(int i){
+    while(i > 0 && timer_key(timer_heap[i]) < timer_key(timer_heap[(i-1)/2])){
+        heap_swap(i, (i-1)/2);
+        i = (i-1)/2;
+    }
+    while(1){
+        int m = i, l = 2*i+1, r = 2*i+2;
+        if(l < timer_heap_len && timer_key(timer_heap[l]) < timer_key(timer_heap[m])) m = l;
+        if(r < timer_heap_len && timer_key(timer_heap[r]) < timer_key(timer_heap[m])) m = r;
+        if(m == i) break;
+        heap_swap(i, m);
+        i = m;
+    }
+}
+
+/* Re-file t after its timer fields changed. Caller holds timer_mtx. */
+static void timer_update(Transaction *t){
+    uint64_t k = timer_key(t);
+    if(t->heap_idx < 0){
+        if(k == 0) return;
+        t->heap_idx = timer_heap_len;
+        timer_heap[timer_heap_len++] = t;
+    } else if(k == 0){
+        int i = t->heap_idx;
+        heap_swap(i, --timer_heap_len);
+        t->heap_idx = -1;
+        if(i < timer_heap_len) heap_fix(i);
+        return;
+    }
+    heap_fix(t->heap_idx);
+    if(timer_heap[0] == t) pthread_cond_signal(&timer_cond);
+}
+
+/* Ask the timer thread to wake t (already marked aborted) if it is blocked. */
+static void timer_wake(Transaction *t){
+    pthread_mutex_lock(&timer_mtx);
+    t->wake_pending = true;
+    timer_update(t);
+    pthread_mutex_unlock(&timer_mtx);
+}
+
+static void lock_unlatch(KeyLock *lk); // lock table, below
+
+static void *timer_thread(void *arg){
+    (void)arg;
+    pthread_mutex_lock(&timer_mtx);
+    while(1){
+        if(timer_heap_len == 0){
+            pthread_cond_wait(&timer_cond, &timer_mtx);
+            continue;
         }
-        it = it->next;
+        Transaction *t = timer_heap[0];
+        uint64_t k = timer_key(t), now = now_ns();
+        if(k > now){
+            struct timespec ts = { (time_t)(k / 1000000000ull), (long)(k % 1000000000ull) };
+            pthread_cond_timedwait(&timer_cond, &timer_mtx, &ts);
+            continue;
+        }
+        if(!t->wake_pending && !t->aborted){
+            t->abort_rc = TXN_TIMEOUT;
+            t->aborted = true;
+        }
+        t->wake_pending = false;
+        t->deadline_ns = t->wait_until_ns = 0; // fired; nothing left to time
+        timer_update(t);
+        KeyLock *lk = t->waiting_on;
+        // t still waits on lk (so lk cannot be freed yet); the pin keeps it alive
+        // after t finishes, until we have woken it
+        if(lk) __atomic_add_fetch(&lk->pins, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&timer_mtx);
+        if(lk){
+            pthread_mutex_lock(&lk->part->latch);
+            pthread_cond_broadcast(&lk->cond);
+            __atomic_sub_fetch(&lk->pins, 1, __ATOMIC_RELAXED);
+            lock_unlatch(lk);
+        }
+        pthread_mutex_lock(&timer_mtx);
     }
-    // insert new
-    KVItem *n = malloc(sizeof(KVItem));
-    strncpy(n->key, key, KEYLEN-1);
-    n->key[KEYLEN-1] = '\0';
-    n->value = value ? strdup(value) : NULL;
-    n->next = s->buckets[idx];
-    s->buckets[idx] = n;
-    pthread_mutex_unlock(&s->mtx);
+    return NULL;
+}
+
+static void timer_start(void){
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_cond_init(&timer_cond, &ca);
+    pthread_condattr_destroy(&ca);
+    pthread_t tid;
+    pthread_create(&tid, NULL, timer_thread, NULL);
+    pthread_detach(tid);
+}
+
+/* Per-txn limits: max time for any single lock wait and for the whole txn from
+   now (0 = unlimited). Exceeding either aborts the txn with TXN_TIMEOUT. */
+static void txn_set_timeouts(Transaction *t, unsigned lock_timeout_ms, unsigned deadline_ms){
+    pthread_mutex_lock(&timer_mtx);
+    t->lock_timeout_ms = lock_timeout_ms;
+    t->deadline_ns = deadline_ms ? now_ns() + deadline_ms * 1000000ull : 0;
+    timer_update(t);
+    pthread_mutex_unlock(&timer_mtx);
+}
+
+/* Defaults picked up by every later txn_begin. */
+static void txn_set_default_timeouts(unsigned lock_timeout_ms, unsigned deadline_ms){
+    pthread_mutex_lock(&timer_mtx);
+    default_lock_timeout_ms = lock_timeout_ms;
+    default_deadline_ms = deadline_ms;
+    pthread_mutex_unlock(&timer_mtx);
+}
+
+/* Bracket a blocking wait on lk. Caller holds lk's latch. */
+static void lock_wait_begin(Transaction *t, KeyLock *lk){
+    pthread_mutex_lock(&timer_mtx);
+    t->waiting_on = lk;
+    t->wait_until_ns = t->lock_timeout_ms ? now_ns() + t->lock_timeout_ms * 1000000ull : 0;
+    timer_update(t);
+    pthread_mutex_unlock(&timer_mtx);
+}
+
+static void lock_wait_end(Transaction *t){
+    pthread_mutex_lock(&timer_mtx);
+    t->waiting_on = NULL;
+    t->wait_until_ns = 0;
+    timer_update(t);
+    pthread_mutex_unlock(&timer_mtx);
 }
 
-/* ---------- Lock initialization ---------- */
+static int txn_err(const Transaction *t){
+    return t->abort_rc ? t->abort_rc : TXN_ABORTED;
+}
+
+/* ---------- Lock table ---------- */
 static void locks_init(void){
-    for(int i=0;i<MAX_KEYS;i++){
-        glocks[i].holder = -1;
-        pthread_mutex_init(&glocks[i].mtx, NULL);
-        pthread_cond_init(&glocks[i].cond, NULL);
+    for(int i=0;i<LOCK_PARTITIONS;i++){
+        pthread_mutex_init(&lock_parts[i].latch, NULL);
+        for(int b=0;b<PART_BUCKETS;b++) lock_parts[i].buckets[b] = NULL;
     }
+    timer_start();
 }
 
-/* ---------- Wait-for graph helpers ---------- */
-static void wf_add_edge(int a, int b){
-    if(a<0 || b<0 || a>=MAX_TXNS || b>=MAX_TXNS) return;
-    wait_for[a][b] = true;
+static KeyLock **lock_bucket(const char *key, LockPartition **part){
+    uint32_t h = hash32(key);
+    *part = &lock_parts[h % LOCK_PARTITIONS];
+    return &(*part)->buckets[(h / LOCK_PARTITIONS) % PART_BUCKETS];
 }
+
+/* Find (or create) the lock of key and return it with its partition latch held.
+   NULL (no latch held) if the key is too long to store or we are out of memory. */
+static KeyLock *lock_lookup_latched(const char *key){
+    if(strlen(key) >= KEYLEN) return NULL;
+    LockPartition *part;
+    KeyLock **head = lock_bucket(key, &part);
+    pthread_mutex_lock(&part->latch);
+    for(KeyLock *lk = *head; lk; lk = lk->next){
+        if(strcmp(lk->key, key) == 0) return lk;
+    }
+    KeyLock *lk = calloc(1, sizeof(KeyLock));
+    if(!lk){
+        pthread_mutex_unlock(&part->latch);
+        return NULL;
+    }
+    strcpy(lk->key, key);
+    lk->holder = -1;
+    pthread_cond_init(&lk->cond, NULL);
+    lk->part = part;
+    lk->next = *head;
+    *head = lk;
+    return lk;
+}
+
+/* Drop lk's partition latch, freeing lk first if it is idle. Waiters sleeping on
+   lk->cond are counted in lk->waiters, so an idle lock has nobody on its cond. */
+static void lock_unlatch(KeyLock *lk){
+    LockPartition *part = lk->part;
+    if(lk->holder == -1 && lk->inc_mask == 0 && lk->waiters == 0 &&
+       __atomic_load_n(&lk->pins, __ATOMIC_RELAXED) == 0){
+        LockPartition *p;
+        KeyLock **pp = lock_bucket(lk->key, &p);
+        while(*pp != lk) pp = &(*pp)->next;
+        *pp = lk->next;
+        pthread_cond_destroy(&lk->cond);
+        free(lk);
+    }
+    pthread_mutex_unlock(&part->latch);
+}
+
+/* ---------- Wait-for graph helpers ---------- */
 static void wf_remove_edge(int a, int b){
     if(a<0 || b<0 || a>=MAX_TXNS || b>=MAX_TXNS) return;
     wait_for[a][b] = false;
@@ -148,11 +942,29 @@ static void wf_remove_incoming_to(int b){
     if(b<0 || b>=MAX_TXNS) return;
     for(int i=0;i<MAX_TXNS;i++) wait_for[i][b] = false;
 }
+/* Make a's outgoing edges exactly the txns in mask; returns true if an edge was added. */
+static bool wf_set_outgoing(int a, uint32_t mask){
+    if(a<0 || a>=MAX_TXNS) return false;
+    bool added = false;
+    for(int j=0;j<MAX_TXNS;j++){
+        bool e = (mask >> j) & 1;
+        if(e && !wait_for[a][j]) added = true;
+        wait_for[a][j] = e;
+    }
+    return added;
+}
 
 /* ---------- Deadlock detection with victim selection ---------- */
 
+/* Work lost if t is aborted: locks held, buffered writes and earlier attempts. */
+static unsigned victim_cost(const Transaction *t){
+    return t->held_count * COST_PER_LOCK + (t->write_cnt + t->add_cnt) * COST_PER_WRITE
+         + t->retries * COST_PER_RETRY;
+}
+
 /* DFS helper to find a cycle and collect nodes in the cycle; returns true if a cycle found.
-   On finding a cycle, it sets *victim to the txn id (with highest start_seq) inside cycle. */
+   On finding a cycle, it sets *victim to the cheapest txn (by victim_cost) inside the
+   cycle, the youngest one (highest start_seq) on ties. */
 static bool dfs_cycle(int u, bool visited[], bool stack[], int parent[], int *victim_out){
     visited[u] = true;
     stack[u] = true;
@@ -172,14 +984,18 @@ static bool dfs_cycle(int u, bool visited[], bool stack[], int parent[], int *vi
                 cycle_nodes[cnt++] = cur;
                 cur = parent[cur];
             }
-            // choose victim: txn with max start_seq
+            // choose victim: lowest cost, youngest on ties
+            // (declared txns are never victims: they only wait in canonical order,
+            //  so every cycle they are part of also contains a 2PL txn)
             int victim = -1;
-            uint64_t max_seq = 0;
+            unsigned min_cost = 0;
             for(int i=0;i<cnt;i++){
                 int t = cycle_nodes[i];
-                if(t>=0 && t<MAX_TXNS && txns[t] != NULL){
-                    if(txns[t]->start_seq > max_seq){
-                        max_seq = txns[t]->start_seq;
+                if(t>=0 && t<MAX_TXNS && txns[t] != NULL && !txns[t]->declared){
+                    unsigned cost = victim_cost(txns[t]);
+                    if(victim == -1 || cost < min_cost ||
+                       (cost == min_cost && txns[t]->start_seq > txns[victim]->start_seq)){
+                        min_cost = cost;
                         victim = t;
                     }
                 }
@@ -209,101 +1025,233 @@ static bool detect_cycle_and_select_victim(int *victim_out){
     return false;
 }
 
-/* ---------- Acquire lock (with wait-for graph & deadlock detection) ---------- */
-static int acquire_lock_txn(Transaction *t, const char *key){
-    if(t->aborted) return -1;
-    unsigned idx = hash_key(key);
-    KeyLock *lk = &glocks[idx];
-
-    pthread_mutex_lock(&lk->mtx);
-    // fast path: free or already held by this txn
-    if(lk->holder == -1 || lk->holder == t->id){
-        lk->holder = t->id;
-        // record held lock (if not already)
-        bool found=false;
-        for(int i=0;i<t->held_count;i++) if(t->held_locks[i]==lk) { found=true; break;}
-        if(!found){
-            t->held_locks[t->held_count++] = lk;
-        }
-        pthread_mutex_unlock(&lk->mtx);
-        // clear outgoing wait edges for t (it now holds a resource)
-        pthread_mutex_lock(&wf_mtx);
-        wf_clear_outgoing(t->id);
-        pthread_mutex_unlock(&wf_mtx);
-        return 0;
+/* Blockers must drop our edges when they release (see release_all_locks). */
+static void mark_waited_on(uint32_t blockers){
+    for(int j=0;j<MAX_TXNS;j++){
+        if(((blockers >> j) & 1) && txns[j] != NULL) txns[j]->has_waiters = true;
     }
+}
 
-    // otherwise need to wait; add wait-for edge t -> holder
+/* Point t's wait edges at the txns blocking it and, if that added an edge, look
+   for a cycle; abort the victim if found. Called again on every wakeup: edges are
+   dropped whenever a holder releases, and the lock may since have gone to another
+   txn (or to a new txn in the same slot). */
+static void wait_edges_and_detect(Transaction *t, uint32_t blockers){
     pthread_mutex_lock(&wf_mtx);
-    wf_add_edge(t->id, lk->holder);
+    if(!wf_set_outgoing(t->id, blockers)){
+        pthread_mutex_unlock(&wf_mtx);
+        return;
+    }
+    mark_waited_on(blockers);
 
     // detect cycle and select victim if any
     int victim = -1;
     if(detect_cycle_and_select_victim(&victim)){
-        if(victim >= 0 && txns[victim] != NULL){
+        if(victim >= 0 && txns[victim] != NULL && !txns[victim]->aborted){
             // mark victim aborted
+            txns[victim]->abort_rc = TXN_ABORTED;
             txns[victim]->aborted = true;
+            deadlock_victims++;
+            timer_wake(txns[victim]);
             // we do NOT immediately remove edges here; victim will cleanup when it wakes/observes aborted
-            fprintf(stderr, "[DEADLOCK] victim chosen txn=%d (seq=%lu)\n",
-                    txns[victim]->id, (unsigned long)txns[victim]->start_seq);
+            fprintf(stderr, "[DEADLOCK] victim chosen txn=%d (seq=%lu cost=%u)\n",
+                    txns[victim]->id, (unsigned long)txns[victim]->start_seq,
+                    victim_cost(txns[victim]));
         }
     }
     pthread_mutex_unlock(&wf_mtx);
+}
+
+/* Txns (bitmask of ids) keeping t from taking lk in mode; 0 means grantable. */
+static uint32_t lock_blockers(const KeyLock *lk, const Transaction *t, LockMode mode){
+    uint32_t b = 0;
+    if(lk->holder != -1 && lk->holder != t->id) b |= 1u << lk->holder;
+    if(mode == LOCK_X) b |= lk->inc_mask & ~(1u << t->id);
+    return b;
+}
+
+/* Grant lk to t in mode (caller checked lock_blockers) and remember it. */
+static void lock_grant(KeyLock *lk, Transaction *t, LockMode mode){
+    bool held = lk->holder == t->id || (lk->inc_mask & (1u << t->id));
+    if(mode == LOCK_X) lk->holder = t->id;
+    else if(lk->holder != t->id) lk->inc_mask |= 1u << t->id;
+    if(held) return;
+    if(t->held_count == t->held_cap){
+        t->held_cap = t->held_cap ? t->held_cap * 2 : 8;
+        t->held_locks = realloc(t->held_locks, t->held_cap * sizeof(KeyLock*));
+    }
+    t->held_locks[t->held_count++] = lk;
+}
+
+/* Wait on lk's condition; the caller holds its partition latch. Wakeups come from
+   releases and from the timer thread (timeouts, deadlock victims). */
+static void lock_wait(KeyLock *lk){
+    pthread_cond_wait(&lk->cond, &lk->part->latch);
+}
 
-    // wait until lock is free or this txn becomes aborted
+/* ---------- Acquire lock (with wait-for graph & deadlock detection) ---------- */
+/* wf_mtx is only taken once t actually has to wait. */
+static int acquire_lock_mode(Transaction *t, const char *key, LockMode mode){
+    if(t->aborted) return txn_err(t);
+    KeyLock *lk = lock_lookup_latched(key);
+    if(!lk) return -1;
+
+    // declared txns already hold every lock they may use; anything else is a bug
+    if(t->declared){
+        int rc = lk->holder == t->id ? 0 : -1;
+        lock_unlatch(lk);
+        return rc;
+    }
+    // fast path: compatible with current holders (or already held by this txn)
+    if(lock_blockers(lk, t, mode) == 0){
+        lock_grant(lk, t, mode);
+        lock_unlatch(lk);
+        return 0;
+    }
+
+    // otherwise wait until lock is grantable or this txn becomes aborted
+    // (deadlock victim or timeout; either way the timer thread wakes us)
+    // Contended locks go to waiters that already hold locks first: everything
+    // queued behind those is stuck until they finish, while a waiter holding
+    // nothing blocks nobody and cannot be part of a deadlock.
+    lock_wait_begin(t, lk);
+    lk->waiters++;
+    bool busy = t->held_count > 0;
+    lk->busy_waiters += busy;
+    int yields = 0;
     while(!t->aborted){
-        if(lk->holder == -1){
+        uint32_t blockers = lock_blockers(lk, t, mode);
+        if(blockers == 0 && !busy && lk->busy_waiters > 0 && yields < HOT_YIELD_MAX){
+            yields++;
+            lock_wait(lk);
+            continue;
+        }
+        if(blockers == 0){
             // acquire
-            lk->holder = t->id;
-            // record held lock
-            bool found=false;
-            for(int i=0;i<t->held_count;i++) if(t->held_locks[i]==lk) { found=true; break;}
-            if(!found){
-                t->held_locks[t->held_count++] = lk;
-            }
+            lk->waiters--;
+            lk->busy_waiters -= busy;
+            lock_grant(lk, t, mode);
+            lock_wait_end(t);
             // clear outgoing edges for this txn
             pthread_mutex_lock(&wf_mtx);
             wf_clear_outgoing(t->id);
             pthread_mutex_unlock(&wf_mtx);
-            pthread_mutex_unlock(&lk->mtx);
+            lock_unlatch(lk);
             return 0;
         }
-        // timed wait so that we periodically re-check aborted flag & potential changes
-        struct timespec ts;
-        clock_gettime(CLOCK_REALTIME, &ts);
-        ts.tv_nsec += 200 * 1000000; // 200 ms
-        if(ts.tv_nsec >= 1000000000){ ts.tv_sec += 1; ts.tv_nsec -= 1000000000; }
-        pthread_cond_timedwait(&lk->cond, &lk->mtx, &ts);
+        // (re)add wait-for edges t -> blockers
+        wait_edges_and_detect(t, blockers);
+        if(t->aborted) break;
+        lock_wait(lk);
         // loop will re-check
     }
+    lk->waiters--;
+    lk->busy_waiters -= busy;
+    // waiters that yielded to us must not sleep on a free lock
+    if(busy) pthread_cond_broadcast(&lk->cond);
+    lock_wait_end(t);
 
     // aborted: cleanup outgoing edges
     pthread_mutex_lock(&wf_mtx);
     wf_clear_outgoing(t->id);
     pthread_mutex_unlock(&wf_mtx);
 
-    pthread_mutex_unlock(&lk->mtx);
-    return -1;
+    lock_unlatch(lk);
+    return txn_err(t);
+}
+
+static int acquire_lock_txn(Transaction *t, const char *key){
+    return acquire_lock_mode(t, key, LOCK_X);
+}
+
+/* ---------- Acquire lock in canonical order (declared txns only) ---------- */
+/* Declared txns lock keys in ascending order, so they never deadlock among
+   themselves. A cycle through a 2PL txn is still possible, and whichever edge closes
+   it runs detection: ours too. Declared txns are never victims, but their waits are
+   still subject to timeouts. */
+static int acquire_lock_ordered(Transaction *t, const char *key){
+    KeyLock *lk = lock_lookup_latched(key);
+    if(!lk) return -1;
+    uint32_t blockers = lock_blockers(lk, t, LOCK_X);
+    if(blockers != 0){
+        lock_wait_begin(t, lk);
+        lk->waiters++;
+        while(blockers != 0 && !t->aborted){
+            // our edge may be the one that closes a cycle; the victim it picks
+            // is always one of the 2PL txns in it
+            wait_edges_and_detect(t, blockers);
+            lock_wait(lk);
+            blockers = lock_blockers(lk, t, LOCK_X);
+        }
+        lk->waiters--;
+        lock_wait_end(t);
+        pthread_mutex_lock(&wf_mtx);
+        wf_clear_outgoing(t->id);
+        pthread_mutex_unlock(&wf_mtx);
+        if(blockers != 0){
+            lock_unlatch(lk);
+            return txn_err(t);
+        }
+    }
+    lock_grant(lk, t, LOCK_X);
+    lock_unlatch(lk);
+    return 0;
 }
 
 /* ---------- Release all locks held by transaction ---------- */
 static void release_all_locks(Transaction *t){
     for(int i=0;i<t->held_count;i++){
         KeyLock *lk = t->held_locks[i];
-        pthread_mutex_lock(&lk->mtx);
+        pthread_mutex_lock(&lk->part->latch);
         if(lk->holder == t->id) lk->holder = -1;
-        // remove incoming edges to this txn (others waiting on it)
+        lk->inc_mask &= ~(1u << t->id);
+        pthread_cond_broadcast(&lk->cond);
+        lock_unlatch(lk);
+    }
+    t->held_count = 0;
+    // remove incoming edges to this txn (others waiting on it), if there are any;
+    // waiters set has_waiters under our lock's latch, before we released it above
+    if(t->has_waiters){
         pthread_mutex_lock(&wf_mtx);
         wf_remove_incoming_to(t->id);
+        t->has_waiters = false;
         pthread_mutex_unlock(&wf_mtx);
-        pthread_cond_broadcast(&lk->cond);
-        pthread_mutex_unlock(&lk->mtx);
     }
-    t->held_count = 0;
+}
+
+/* ---------- 2PL / epoch gate ---------- */
+static void gate_enter_2pl(void){
+    pthread_mutex_lock(&gate_mtx);
+    while(gate_epoch) pthread_cond_wait(&gate_cond, &gate_mtx);
+    gate_2pl++;
+    pthread_mutex_unlock(&gate_mtx);
+}
+
+static void gate_exit_2pl(void){
+    pthread_mutex_lock(&gate_mtx);
+    if(--gate_2pl == 0 && gate_epoch) pthread_cond_broadcast(&gate_cond);
+    pthread_mutex_unlock(&gate_mtx);
+}
+
+static void gate_enter_epoch(void){
+    pthread_mutex_lock(&gate_mtx);
+    gate_epoch = true; // new 2PL txns wait from now on
+    while(gate_2pl > 0) pthread_cond_wait(&gate_cond, &gate_mtx);
+    pthread_mutex_unlock(&gate_mtx);
+}
+
+static void gate_exit_epoch(void){
+    pthread_mutex_lock(&gate_mtx);
+    gate_epoch = false;
+    pthread_cond_broadcast(&gate_cond);
+    pthread_mutex_unlock(&gate_mtx);
 }
 
 /* ---------- Transaction lifecycle ---------- */
-static Transaction* txn_begin(void){
+/* seq == 0 starts a fresh txn; a retry passes the seq of its first attempt so it
+   keeps its age for victim selection. */
+static Transaction* txn_begin_at(uint64_t seq, int retries){
+    gate_enter_2pl();
     pthread_mutex_lock(&txn_mtx);
     int slot = -1;
     for(int i=0;i<MAX_TXNS;i++){
@@ -314,51 +1262,113 @@ static Transaction* txn_begin(void){
     }
     if(slot == -1){
         pthread_mutex_unlock(&txn_mtx);
+        gate_exit_2pl();
         return NULL;
     }
     Transaction *t = calloc(1, sizeof(Transaction));
     t->id = slot;
-    t->start_seq = ++seq_counter;
+    t->start_seq = seq ? seq : ++seq_counter;
+    t->retries = retries;
     t->aborted = false;
     t->held_count = 0;
     t->write_cnt = 0;
+    t->heap_idx = -1;
     txns[slot] = t;
     pthread_mutex_unlock(&txn_mtx);
+
+    pthread_mutex_lock(&timer_mtx);
+    unsigned lock_ms = default_lock_timeout_ms, deadline_ms = default_deadline_ms;
+    pthread_mutex_unlock(&timer_mtx);
+    if(lock_ms || deadline_ms) txn_set_timeouts(t, lock_ms, deadline_ms);
     return t;
 }
 
+static Transaction* txn_begin(void){
+    return txn_begin_at(0, 0);
+}
+
 static void txn_free(Transaction *t){
     if(!t) return;
     // free local buffered writes
     for(int i=0;i<t->write_cnt;i++){
         free(t->write_set[i].value);
     }
+    free(t->held_locks);
+    if(t->id >= 0){
+        // the timer thread must not touch t once it is freed
+        pthread_mutex_lock(&timer_mtx);
+        t->deadline_ns = t->wait_until_ns = 0;
+        t->wake_pending = false;
+        timer_update(t);
+        pthread_mutex_unlock(&timer_mtx);
+    }
     pthread_mutex_lock(&txn_mtx);
     if(t->id >= 0 && t->id < MAX_TXNS && txns[t->id] == t) txns[t->id] = NULL;
     pthread_mutex_unlock(&txn_mtx);
+    if(t->id >= 0) gate_exit_2pl();
     free(t);
 }
 
-/* ---------- Transactional operations ---------- */
-static int txn_get(Transaction *t, const char *key, char **out_val){
-    if(t->aborted) return -1;
-    // if present in write set return latest
-    for(int i=0;i<t->write_cnt;i++){
-        if(strcmp(t->write_set[i].key, key) == 0){
-            *out_val = strdup(t->write_set[i].value);
-            return 0;
-        }
+/* ---------- Deterministic txns: check access against the declared sets ---------- */
+static int det_allowed(const Transaction *t, const char *key, bool write){
+    unsigned idx = hash_key(key);
+    const DetTxn *d = t->det;
+    int lo = 0, hi = d->nlocks - 1;
+    while(lo <= hi){
+        int mid = (lo + hi) / 2;
+        if(d->locks[mid] == idx) return (!write || d->write[mid]) ? 0 : -1;
+        if(d->locks[mid] < idx) lo = mid + 1; else hi = mid - 1;
+    }
+    return -1;
+}
+
+/* ---------- Read-only transactions ---------- */
+/* No slot in txns[], no locks, no wait-for edges. The txn sees the store as of
+   the last published commit; a read of an item written by a later commit (or
+   by the commit being applied) fails and the txn must be retried. */
+static Transaction* txn_begin_ro(void){
+    Transaction *t = calloc(1, sizeof(Transaction));
+    t->id = -1;
+    t->heap_idx = -1;
+    t->read_only = true;
+    t->snapshot = __atomic_load_n(&commit_seq, __ATOMIC_ACQUIRE);
+    return t;
+}
+
+static int txn_get_ro(Transaction *t, const char *key, char **out_val){
+    uint64_t version;
+    char *v;
+    if(kv_read_at(&gkv, key, &v, &version) < 0) return -1;
+    if(version > t->snapshot){
+        free(v);
+        t->aborted = true;
+        return -1;
     }
-    if(acquire_lock_txn(t, key) < 0) return -1;
-    char *v = kv_read(&gkv, key);
     *out_val = v;
     return 0;
 }
 
-static int txn_put(Transaction *t, const char *key, const char *value){
-    if(t->aborted) return -1;
-    if(acquire_lock_txn(t, key) < 0) return -1;
-    // buffer the write
+/* ---------- Local write / delta sets ---------- */
+static int find_write(const Transaction *t, const char *key){
+    for(int i=0;i<t->write_cnt;i++) if(strcmp(t->write_set[i].key, key) == 0) return i;
+    return -1;
+}
+
+static int find_add(const Transaction *t, const char *key){
+    for(int i=0;i<t->add_cnt;i++) if(strcmp(t->add_set[i].key, key) == 0) return i;
+    return -1;
+}
+
+/* Buffer value for key, replacing an earlier buffered write or pending delta. */
+static int buffer_write(Transaction *t, const char *key, const char *value){
+    int a = find_add(t, key);
+    if(a >= 0) t->add_set[a] = t->add_set[--t->add_cnt];
+    int w = find_write(t, key);
+    if(w >= 0){
+        free(t->write_set[w].value);
+        t->write_set[w].value = strdup(value);
+        return 0;
+    }
     if(t->write_cnt >= MAX_WRITES) return -1;
     strncpy(t->write_set[t->write_cnt].key, key, KEYLEN-1);
     t->write_set[t->write_cnt].key[KEYLEN-1]=0;
@@ -367,21 +1377,101 @@ static int txn_put(Transaction *t, const char *key, const char *value){
     return 0;
 }
 
+/* ---------- Transactional operations ---------- */
+static int txn_get(Transaction *t, const char *key, char **out_val){
+    if(t->aborted) return txn_err(t);
+    if(t->read_only) return txn_get_ro(t, key, out_val);
+    // if present in write set return latest
+    int w = find_write(t, key);
+    if(w >= 0){
+        *out_val = strdup(t->write_set[w].value);
+        return 0;
+    }
+    if(t->det){
+        if(det_allowed(t, key, false) < 0) return TXN_ABORTED;
+    } else {
+        int rc = acquire_lock_txn(t, key);
+        if(rc < 0) return rc;
+    }
+    char *v;
+    if(kv_read_at(&gkv, key, &v, NULL) < 0) return -1;
+    int a = find_add(t, key);
+    if(a >= 0){
+        // reading our own pending delta: we now hold X, so fold it into a plain write
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%lld", (v ? strtoll(v, NULL, 10) : 0) + t->add_set[a].delta);
+        free(v);
+        if(buffer_write(t, key, buf) < 0) return -1;
+        v = strdup(buf);
+    }
+    *out_val = v;
+    return 0;
+}
+
+static int txn_put(Transaction *t, const char *key, const char *value){
+    if(t->aborted) return txn_err(t);
+    if(t->read_only) return TXN_ABORTED;
+    if(t->det){
+        if(det_allowed(t, key, true) < 0) return TXN_ABORTED;
+    } else {
+        int rc = acquire_lock_txn(t, key);
+        if(rc < 0) return rc;
+    }
+    // buffer the write
+    return buffer_write(t, key, value);
+}
+
+/* Add delta to the integer under key at commit. Only takes an increment lock, which
+   is compatible with other txns' increments, so hot counters do not serialize. */
+static int txn_add(Transaction *t, const char *key, long long delta){
+    if(t->aborted) return txn_err(t);
+    if(t->read_only) return TXN_ABORTED;
+    int w = find_write(t, key);
+    if(w >= 0){
+        // already written (and X-locked) by us: update the buffered value
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%lld", strtoll(t->write_set[w].value, NULL, 10) + delta);
+        return buffer_write(t, key, buf);
+    }
+    int a = find_add(t, key);
+    if(a >= 0){
+        t->add_set[a].delta += delta;
+        return 0;
+    }
+    if(t->det){
+        if(det_allowed(t, key, true) < 0) return TXN_ABORTED;
+    } else {
+        int rc = acquire_lock_mode(t, key, LOCK_INC);
+        if(rc < 0) return rc;
+    }
+    if(t->add_cnt >= MAX_WRITES) return -1;
+    strncpy(t->add_set[t->add_cnt].key, key, KEYLEN-1);
+    t->add_set[t->add_cnt].key[KEYLEN-1]=0;
+    t->add_set[t->add_cnt].delta = delta;
+    t->add_cnt++;
+    return 0;
+}
+
 static int txn_commit(Transaction *t){
     if(t->aborted){
+        int rc = txn_err(t);
         release_all_locks(t);
         txn_free(t);
-        return -1;
+        return rc;
     }
-    // apply buffered writes atomically (we serialize on store lock inside kv_write)
-    for(int i=0;i<t->write_cnt;i++){
-        kv_write(&gkv, t->write_set[i].key, t->write_set[i].value);
+    // apply buffered writes as one commit version; read-only txns that started
+    // earlier fail validation on these keys instead of seeing a partial commit
+    if(t->write_cnt > 0 || t->add_cnt > 0){
+        uint64_t version = commit_begin();
+        for(int i=0;i<t->write_cnt;i++){
+            kv_write_at(&gkv, t->write_set[i].key, t->write_set[i].value, version);
+        }
+        for(int i=0;i<t->add_cnt;i++){
+            kv_add_at(&gkv, t->add_set[i].key, t->add_set[i].delta, version);
+        }
+        commit_end(version);
     }
-    // clear outgoing edges and release locks
-    pthread_mutex_lock(&wf_mtx);
-    wf_clear_outgoing(t->id);
-    pthread_mutex_unlock(&wf_mtx);
-
+    // outgoing edges only exist while waiting, so releasing is all that is left
     release_all_locks(t);
     txn_free(t);
     return 0;
@@ -389,13 +1479,307 @@ static int txn_commit(Transaction *t){
 
 static void txn_abort(Transaction *t){
     t->aborted = true;
-    pthread_mutex_lock(&wf_mtx);
-    wf_clear_outgoing(t->id);
-    pthread_mutex_unlock(&wf_mtx);
     release_all_locks(t);
     txn_free(t);
 }
 
+/* ---------- One-shot transactions with pre-declared key sets ---------- */
+typedef int (*txn_body_fn)(Transaction *t, void *arg);
+
+static int cmp_uint(const void *a, const void *b){
+    unsigned x = *(const unsigned*)a, y = *(const unsigned*)b;
+    return (x > y) - (x < y);
+}
+
+static int cmp_str(const void *a, const void *b){
+    return strcmp(*(const char *const*)a, *(const char *const*)b);
+}
+
+/* Run fn inside a transaction that holds the locks of all nkeys keys for its whole
+   lifetime. Keys are sorted and deduplicated and locked in that order, so declared
+   txns can never deadlock each other.
+   fn may only touch declared keys; it returns 0 to commit, anything else aborts.
+   Returns 0 on commit, TXN_TIMEOUT if a lock wait or the deadline ran out,
+   TXN_ABORTED otherwise. */
+static int txn_run(const char *const keys[], int nkeys, txn_body_fn fn, void *arg){
+    if(nkeys < 0 || nkeys > MAX_KEYS) return -1;
+    const char *sorted[MAX_KEYS];
+    memcpy(sorted, keys, nkeys * sizeof(keys[0]));
+    qsort(sorted, nkeys, sizeof(sorted[0]), cmp_str);
+    int n = 0;
+    for(int i=0;i<nkeys;i++){
+        if(n == 0 || strcmp(sorted[n-1], sorted[i]) != 0) sorted[n++] = sorted[i];
+    }
+
+    Transaction *t = txn_begin();
+    if(!t) return TXN_ABORTED;
+    t->declared = true;
+    for(int i=0;i<n;i++){
+        int rc = acquire_lock_ordered(t, sorted[i]);
+        if(rc < 0){
+            txn_abort(t);
+            return rc;
+        }
+    }
+
+    if(fn(t, arg) != 0){
+        int rc = t->aborted ? txn_err(t) : TXN_ABORTED;
+        txn_abort(t);
+        return rc;
+    }
+    return txn_commit(t);
+}
+
+/* ---------- Automatic retry with jittered exponential backoff ---------- */
+/* Run fn in a fresh 2PL txn and commit; if it is aborted (deadlock victim or fn
+   failure) retry up to max_attempts times. Retries keep the original start_seq and
+   carry their retry count, so they grow more expensive to pick as victim. Between
+   attempts we sleep a random time in [0, min(base * 2^attempt, max)).
+   A timeout is not retried: it means the caller's latency budget is spent.
+   Returns 0 once committed, TXN_TIMEOUT, or TXN_ABORTED when attempts run out. */
+static int txn_retry(txn_body_fn fn, void *arg, int max_attempts){
+    unsigned seed = (unsigned)time(NULL) ^ (unsigned)(uintptr_t)pthread_self();
+    uint64_t seq = 0;
+    for(int attempt=0; attempt<max_attempts; attempt++){
+        if(attempt > 0){
+            unsigned cap = BACKOFF_BASE_US << (attempt < 8 ? attempt : 8);
+            if(cap > BACKOFF_MAX_US) cap = BACKOFF_MAX_US;
+            usleep(rand_r(&seed) % cap);
+        }
+        Transaction *t = txn_begin_at(seq, attempt);
+        if(!t) continue; // no free slot, back off and try again
+        if(seq == 0) seq = t->start_seq;
+        if(fn(t, arg) != 0){
+            int rc = t->aborted ? txn_err(t) : TXN_ABORTED;
+            txn_abort(t);
+            if(rc == TXN_TIMEOUT) return rc;
+            continue;
+        }
+        int rc = txn_commit(t);
+        if(rc == 0 || rc == TXN_TIMEOUT) return rc;
+    }
+    return TXN_ABORTED;
+}
+
+/* ---------- Deterministic batched execution (Calvin-style) ---------- */
+/* det_submit() appends a txn with declared read/write sets to the current epoch.
+   Every DET_EPOCH_US (or when the epoch is full) the sequencer closes the epoch and
+   runs it: each txn is ordered after the earlier txns of the same epoch it conflicts
+   with, and DET_WORKERS threads execute txns as soon as all their predecessors are
+   done. Locks are thus granted in epoch order, so there is no deadlock detection and
+   no conflict abort. Deterministic txns do not take KeyLocks; instead an epoch waits
+   for open 2PL txns to finish and holds off new ones until it is done (see gate_*).
+   A thread must not call det_submit() while it has a 2PL txn open. */
+typedef struct {
+    DetTxn *txns[DET_EPOCH_MAX];
+    int n;
+} DetEpoch;
+
+static DetEpoch det_epochs[2];         // [det_cur] fills while the other executes
+static int det_cur = 0;
+static uint64_t det_epoch_no = 0;      // epochs executed so far
+static bool det_running = false;
+static int det_waiting = 0;            // det_submit() callers not yet returned
+static pthread_mutex_t det_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t det_fill_cond = PTHREAD_COND_INITIALIZER; // epoch full / slot free
+static pthread_cond_t det_done_cond = PTHREAD_COND_INITIALIZER; // epoch finished
+
+/* executor state for the epoch being run */
+static DetEpoch *det_exec;
+static int det_ready[DET_EPOCH_MAX], det_ready_cnt, det_left;
+static pthread_mutex_t det_exec_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t det_exec_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t det_idle_cond = PTHREAD_COND_INITIALIZER;
+
+static void det_add_edge(DetEpoch *e, int from, int to){
+    DetTxn *a = e->txns[from];
+    if(a->nsucc == a->capsucc){
+        a->capsucc = a->capsucc ? a->capsucc * 2 : 4;
+        a->succ = realloc(a->succ, a->capsucc * sizeof(int));
+    }
+    a->succ[a->nsucc++] = to;
+    e->txns[to]->pending++;
+}
+
+/* Build the conflict DAG in epoch order: a writer waits for the readers since the
+   last writer (or that writer), a reader waits for the last writer. */
+static void det_build_deps(DetEpoch *e){
+    static int last_writer[MAX_KEYS];
+    static int readers[MAX_KEYS][DET_EPOCH_MAX];
+    static int nreaders[MAX_KEYS];
+    for(int l=0;l<MAX_KEYS;l++){ last_writer[l] = -1; nreaders[l] = 0; }
+
+    for(int i=0;i<e->n;i++){
+        DetTxn *d = e->txns[i];
+        for(int k=0;k<d->nlocks;k++){
+            unsigned l = d->locks[k];
+            if(d->write[k]){
+                if(nreaders[l] > 0){
+                    for(int r=0;r<nreaders[l];r++) det_add_edge(e, readers[l][r], i);
+                } else if(last_writer[l] >= 0){
+                    det_add_edge(e, last_writer[l], i);
+                }
+                last_writer[l] = i;
+                nreaders[l] = 0;
+            } else {
+                if(last_writer[l] >= 0) det_add_edge(e, last_writer[l], i);
+                readers[l][nreaders[l]++] = i;
+            }
+        }
+    }
+}
+
+static void det_execute_one(DetTxn *d){
+    Transaction *t = calloc(1, sizeof(Transaction));
+    t->id = -1; // not registered in txns[]: never part of the wait-for graph
+    t->heap_idx = -1;
+    t->det = d;
+    if(d->fn(t, d->arg) != 0){
+        txn_abort(t);
+        d->rc = -1;
+    } else {
+        d->rc = txn_commit(t);
+    }
+}
+
+static void *det_worker(void *arg){
+    (void)arg;
+    pthread_mutex_lock(&det_exec_mtx);
+    while(1){
+        while(det_ready_cnt == 0) pthread_cond_wait(&det_exec_cond, &det_exec_mtx);
+        int i = det_ready[--det_ready_cnt];
+        DetEpoch *e = det_exec;
+        pthread_mutex_unlock(&det_exec_mtx);
+
+        det_execute_one(e->txns[i]);
+
+        pthread_mutex_lock(&det_exec_mtx);
+        DetTxn *d = e->txns[i];
+        for(int s=0;s<d->nsucc;s++){
+            if(--e->txns[d->succ[s]]->pending == 0){
+                det_ready[det_ready_cnt++] = d->succ[s];
+                pthread_cond_signal(&det_exec_cond);
+            }
+        }
+        if(--det_left == 0) pthread_cond_signal(&det_idle_cond);
+    }
+    return NULL;
+}
+
+static void det_run_epoch(DetEpoch *e){
+    det_build_deps(e);
+    gate_enter_epoch();
+    pthread_mutex_lock(&det_exec_mtx);
+    det_exec = e;
+    det_left = e->n;
+    det_ready_cnt = 0;
+    for(int i=0;i<e->n;i++){
+        if(e->txns[i]->pending == 0) det_ready[det_ready_cnt++] = i;
+    }
+    pthread_cond_broadcast(&det_exec_cond);
+    while(det_left > 0) pthread_cond_wait(&det_idle_cond, &det_exec_mtx);
+    pthread_mutex_unlock(&det_exec_mtx);
+    gate_exit_epoch();
+}
+
+static void *det_sequencer(void *arg){
+    (void)arg;
+    pthread_mutex_lock(&det_mtx);
+    while(1){
+        while(det_epochs[det_cur].n == 0) pthread_cond_wait(&det_fill_cond, &det_mtx);
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += DET_EPOCH_US * 1000;
+        if(ts.tv_nsec >= 1000000000){ ts.tv_sec += 1; ts.tv_nsec -= 1000000000; }
+        // close early once every waiting caller is in: no one else is about to submit
+        while(det_epochs[det_cur].n < DET_EPOCH_MAX && det_epochs[det_cur].n < det_waiting &&
+              pthread_cond_timedwait(&det_fill_cond, &det_mtx, &ts) == 0)
+            ;
+        DetEpoch *e = &det_epochs[det_cur];
+        det_cur ^= 1; // new submissions go to the other epoch
+        pthread_cond_broadcast(&det_fill_cond);
+        pthread_mutex_unlock(&det_mtx);
+
+        det_run_epoch(e);
+
+        pthread_mutex_lock(&det_mtx);
+        for(int i=0;i<e->n;i++) e->txns[i]->done = true;
+        e->n = 0;
+        det_epoch_no++;
+        pthread_cond_broadcast(&det_done_cond);
+    }
+    return NULL;
+}
+
+static void det_start(void){
+    pthread_mutex_lock(&det_mtx);
+    if(!det_running){
+        pthread_t tid;
+        for(int i=0;i<DET_WORKERS;i++){
+            pthread_create(&tid, NULL, det_worker, NULL);
+            pthread_detach(tid);
+        }
+        pthread_create(&tid, NULL, det_sequencer, NULL);
+        pthread_detach(tid);
+        det_running = true;
+    }
+    pthread_mutex_unlock(&det_mtx);
+}
+
+/* Submit fn with its read and write key sets and wait until its epoch has run.
+   fn may only read keys in reads/writes and only write keys in writes.
+   Returns 0 if fn committed, -1 if it returned an error (its writes are dropped). */
+static int det_submit(const char *const reads[], int nr, const char *const writes[], int nw,
+                      txn_body_fn fn, void *arg){
+    if(nr < 0 || nw < 0 || nr + nw > MAX_KEYS) return -1;
+    DetTxn *d = calloc(1, sizeof(DetTxn));
+    d->fn = fn;
+    d->arg = arg;
+    // collect (lock, mode) pairs; a lock both read and written is a write
+    unsigned tmp[MAX_KEYS];
+    for(int i=0;i<nw;i++) tmp[i] = hash_key(writes[i]);
+    for(int i=0;i<nr;i++) tmp[nw+i] = hash_key(reads[i]);
+    qsort(tmp, nr + nw, sizeof(tmp[0]), cmp_uint);
+    for(int i=0;i<nr+nw;i++){
+        if(d->nlocks == 0 || d->locks[d->nlocks-1] != tmp[i]) d->locks[d->nlocks++] = tmp[i];
+    }
+    for(int i=0;i<nw;i++){
+        unsigned idx = hash_key(writes[i]);
+        for(int k=0;k<d->nlocks;k++) if(d->locks[k] == idx) d->write[k] = true;
+    }
+
+    det_start();
+    pthread_mutex_lock(&det_mtx);
+    while(det_epochs[det_cur].n == DET_EPOCH_MAX) pthread_cond_wait(&det_fill_cond, &det_mtx);
+    DetEpoch *e = &det_epochs[det_cur];
+    e->txns[e->n++] = d;
+    det_waiting++;
+    if(e->n == 1 || e->n == DET_EPOCH_MAX || e->n == det_waiting) pthread_cond_broadcast(&det_fill_cond);
+    while(!d->done) pthread_cond_wait(&det_done_cond, &det_mtx);
+    det_waiting--;
+    pthread_mutex_unlock(&det_mtx);
+
+    int rc = d->rc;
+    free(d->succ);
+    free(d);
+    return rc;
+}
+
+/* ---------- Read-only runner ---------- */
+/* Run a read-only fn without locks; if it keeps hitting concurrent commits, fall
+   back to a locking txn so it cannot starve. Returns 0 once fn succeeded. */
+static int txn_run_ro(txn_body_fn fn, void *arg){
+    for(int attempt=0; attempt<RO_ATTEMPTS; attempt++){
+        Transaction *t = txn_begin_ro();
+        int rc = fn(t, arg);
+        bool stale = t->aborted;
+        txn_abort(t); // nothing to apply either way
+        if(rc == 0 && !stale) return 0;
+        if(!stale) return -1; // fn failed on its own, retrying will not help
+    }
+    return txn_retry(fn, arg, RO_ATTEMPTS);
+}
+
 /* ---------- Demo threads (classic deadlock) ---------- */
 void *thread1_fn(void *arg){
     Transaction *t = txn_begin();
@@ -445,13 +1829,330 @@ void *thread2_fn(void *arg){
     return NULL;
 }
 
+/* ---------- Demo: the same swap as one-shot txns (no deadlock possible) ---------- */
+typedef struct { const char *src, *dst; } MoveArgs;
+
+static int move_body(Transaction *t, void *arg){
+    MoveArgs *m = arg;
+    char *v;
+    if(txn_get(t, m->src, &v) < 0) return -1;
+    usleep(100000); // keep the locks for a while, like T1/T2 above
+    int rc = txn_put(t, m->dst, v ? v : "");
+    free(v);
+    return rc;
+}
+
+void *oneshot_fn(void *arg){
+    MoveArgs *m = arg;
+    const char *keys[] = { m->src, m->dst };
+    if(txn_run(keys, 2, move_body, m) == 0) printf("one-shot %s->%s committed\n", m->src, m->dst);
+    else printf("one-shot %s->%s failed\n", m->src, m->dst);
+    return NULL;
+}
+
+/* ---------- Demo: classic deadlock again, resolved by automatic retry ---------- */
+void *retry_fn(void *arg){
+    MoveArgs *m = arg;
+    if(txn_retry(move_body, m, 5) == 0) printf("retried %s->%s committed\n", m->src, m->dst);
+    else printf("retried %s->%s gave up\n", m->src, m->dst);
+    return NULL;
+}
+
+/* ---------- Demo: bounded lock wait ---------- */
+static int hold_x_body(Transaction *t, void *arg){
+    (void)arg;
+    char *v;
+    if(txn_get(t, "x", &v) < 0) return -1;
+    free(v);
+    usleep(300000); // slow, but not deadlocked
+    return 0;
+}
+
+void *slow_holder_fn(void *arg){
+    (void)arg;
+    txn_retry(hold_x_body, NULL, 1);
+    return NULL;
+}
+
+/* ---------- Demo: lock-free read-only snapshot ---------- */
+static int print_xy_body(Transaction *t, void *arg){
+    (void)arg;
+    char *vx, *vy;
+    if(txn_get(t, "x", &vx) < 0) return -1;
+    if(txn_get(t, "y", &vy) < 0){ free(vx); return -1; }
+    printf("read-only: x=%s y=%s\n", vx?vx:"(null)", vy?vy:"(null)");
+    free(vx); free(vy);
+    return 0;
+}
+
+/* ---------- Bench: high-contention increments, 2PL vs deterministic ---------- */
+#define BENCH_THREADS 8
+#define BENCH_TXNS 200       // per thread
+#define BENCH_HOT_KEYS 8
+#define BENCH_KEYS_PER_TXN 2
+#define BENCH_WORK_US 100    // simulated work per key while its lock is held
+#define BENCH_ZIPF_KEYS 64   // key space of the skewed runs
+
+typedef struct { const char *keys[BENCH_KEYS_PER_TXN]; } IncrArgs;
+
+static const char *bench_keys[BENCH_HOT_KEYS] = { "h0","h1","h2","h3","h4","h5","h6","h7" };
+static char zipf_names[BENCH_ZIPF_KEYS][8];
+static const char *zipf_keys[BENCH_ZIPF_KEYS];
+static double zipf_cdf[BENCH_ZIPF_KEYS];
+
+static void zipf_init(void){
+    double sum = 0;
+    for(int i=0;i<BENCH_ZIPF_KEYS;i++){
+        snprintf(zipf_names[i], sizeof(zipf_names[i]), "z%d", i);
+        zipf_keys[i] = zipf_names[i];
+        sum += 1.0 / (i + 1); // Zipf, s=1: a few keys take most of the traffic
+        zipf_cdf[i] = sum;
+    }
+    for(int i=0;i<BENCH_ZIPF_KEYS;i++) zipf_cdf[i] /= sum;
+}
+
+static int zipf_pick(unsigned *seed){
+    double u = rand_r(seed) / ((double)RAND_MAX + 1);
+    int lo = 0, hi = BENCH_ZIPF_KEYS - 1;
+    while(lo < hi){
+        int mid = (lo + hi) / 2;
+        if(zipf_cdf[mid] > u) hi = mid; else lo = mid + 1;
+    }
+    return lo;
+}
+
+static int incr_body(Transaction *t, void *arg){
+    IncrArgs *a = arg;
+    for(int i=0;i<BENCH_KEYS_PER_TXN;i++){
+        char *v, buf[32];
+        if(txn_get(t, a->keys[i], &v) < 0) return -1;
+        usleep(BENCH_WORK_US);
+        snprintf(buf, sizeof(buf), "%ld", (v ? atol(v) : 0) + 1);
+        free(v);
+        if(txn_put(t, a->keys[i], buf) < 0) return -1;
+    }
+    return 0;
+}
+
+static int add_body(Transaction *t, void *arg){
+    IncrArgs *a = arg;
+    for(int i=0;i<BENCH_KEYS_PER_TXN;i++){
+        usleep(BENCH_WORK_US);
+        if(txn_add(t, a->keys[i], 1) < 0) return -1;
+    }
+    return 0;
+}
+
+/* The zipf run is 2pl+retry over a skewed key space. */
+typedef enum { BENCH_2PL, BENCH_DET, BENCH_ADD, BENCH_ZIPF } BenchMode;
+static const char *bench_names[] = { "2pl+retry", "deterministic", "txn_add", "zipf" };
+static BenchMode bench_mode; // which engine bench_thread drives
+
+static void *bench_thread(void *arg){
+    unsigned seed = (unsigned)(uintptr_t)arg;
+    bool zipf = bench_mode == BENCH_ZIPF;
+    for(int n=0;n<BENCH_TXNS;n++){
+        IncrArgs a;
+        if(zipf){
+            int k0 = zipf_pick(&seed), k1;
+            do k1 = zipf_pick(&seed); while(k1 == k0);
+            a.keys[0] = zipf_keys[k0];
+            a.keys[1] = zipf_keys[k1];
+        } else {
+            int k0 = rand_r(&seed) % BENCH_HOT_KEYS;
+            int k1 = (k0 + 1 + rand_r(&seed) % (BENCH_HOT_KEYS - 1)) % BENCH_HOT_KEYS;
+            a.keys[0] = bench_keys[k0];
+            a.keys[1] = bench_keys[k1];
+        }
+        int rc;
+        switch(bench_mode){
+        case BENCH_DET: rc = det_submit(NULL, 0, a.keys, BENCH_KEYS_PER_TXN, incr_body, &a); break;
+        case BENCH_ADD: rc = txn_retry(add_body, &a, 1000); break;
+        default:        rc = txn_retry(incr_body, &a, 1000); break;
+        }
+        if(rc != 0) fprintf(stderr, "bench txn failed\n");
+    }
+    return NULL;
+}
+
+static void bench_run(BenchMode mode){
+    bool zipf = mode == BENCH_ZIPF;
+    const char **keys = zipf ? zipf_keys : bench_keys;
+    int nkeys = zipf ? BENCH_ZIPF_KEYS : BENCH_HOT_KEYS;
+    kv_flush(&gkv);
+    for(int i=0;i<nkeys;i++) kv_write(&gkv, keys[i], "0");
+    pthread_mutex_lock(&wf_mtx);
+    unsigned long victims0 = deadlock_victims;
+    pthread_mutex_unlock(&wf_mtx);
+    uint64_t epochs0 = det_epoch_no;
+
+    bench_mode = mode;
+    struct timespec a, b;
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    pthread_t th[BENCH_THREADS];
+    for(int i=0;i<BENCH_THREADS;i++) pthread_create(&th[i], NULL, bench_thread, (void*)(uintptr_t)(i + 1));
+    for(int i=0;i<BENCH_THREADS;i++) pthread_join(th[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &b);
+
+    double secs = (b.tv_sec - a.tv_sec) + (b.tv_nsec - a.tv_nsec) / 1e9;
+    long sum = 0;
+    for(int i=0;i<nkeys;i++){
+        char *v = kv_read(&gkv, keys[i]);
+        sum += atol(v);
+        free(v);
+    }
+    int total = BENCH_THREADS * BENCH_TXNS;
+    pthread_mutex_lock(&wf_mtx);
+    unsigned long victims = deadlock_victims - victims0;
+    pthread_mutex_unlock(&wf_mtx);
+    printf("%-14s %6d txns in %7.3fs  %9.0f txn/s  aborts=%lu epochs=%lu  check=%s\n",
+           bench_names[mode], total, secs, total / secs, victims,
+           (unsigned long)(det_epoch_no - epochs0),
+           sum == (long)total * BENCH_KEYS_PER_TXN ? "ok" : "MISMATCH");
+}
+
+/* Latency of overwriting a big value with a small one: the old value's free is on
+   the write path unless lazy free takes it. */
+#define BENCH_BIG_BYTES (16 << 20)
+#define BENCH_BIG_ROUNDS 20
+
+static void bench_bigfree(bool lazy){
+    char *big = malloc(BENCH_BIG_BYTES + 1);
+    memset(big, 'v', BENCH_BIG_BYTES);
+    big[BENCH_BIG_BYTES] = '\0';
+    size_t cmin = compress_min;
+    compress_min = 0; // it would compress to nothing
+    lazyfree_on = lazy;
+    uint64_t worst = 0, total = 0;
+    for(int i=0;i<BENCH_BIG_ROUNDS;i++){
+        kv_write(&gkv, "big", big);
+        uint64_t t0 = now_ns();
+        kv_write(&gkv, "big", "0");
+        uint64_t d = now_ns() - t0;
+        total += d;
+        if(d > worst) worst = d;
+        usleep(20000); // let the reclaimer catch up between rounds
+    }
+    lazyfree_on = true;
+    compress_min = cmin;
+    free(big);
+    printf("overwrite %dMB value, %-8s avg %6.1fus  max %6.1fus\n", BENCH_BIG_BYTES >> 20,
+           lazy ? "lazy:" : "inline:", total / 1e3 / BENCH_BIG_ROUNDS, worst / 1e3);
+}
+
+/* Fragment the heap (many mid-size values, then most of them shrunk) and let the
+   defrag thread repair it. */
+#define BENCH_FRAG_KEYS 20000
+
+static void bench_defrag(void){
+    unsigned seed = 1;
+    char key[KEYLEN], *val = malloc(4097);
+    size_t cmin = compress_min;
+    compress_min = 0; // fragment with raw values
+    defrag_on = false;
+    usleep(DEFRAG_CHECK_MS * 2000); // let a pass already under way finish
+    for(int i=0;i<BENCH_FRAG_KEYS;i++){
+        size_t len = 64 + rand_r(&seed) % 4032;
+        memset(val, 'a' + i % 26, len);
+        val[len] = '\0';
+        snprintf(key, sizeof(key), "f%d", i);
+        kv_write(&gkv, key, val);
+    }
+    free(val);
+    for(int i=0;i<BENCH_FRAG_KEYS;i++){
+        if(i % 10 == 0) continue; // keep every tenth
+        snprintf(key, sizeof(key), "f%d", i);
+        kv_write(&gkv, key, "0");
+    }
+    FragInfo before = frag_info();
+    unsigned long passes0 = __atomic_load_n(&defrag_passes, __ATOMIC_ACQUIRE);
+    defrag_on = true;
+    uint64_t t0 = now_ns();
+    while(__atomic_load_n(&defrag_passes, __ATOMIC_ACQUIRE) == passes0 && now_ns() - t0 < 5000000000ull)
+        usleep(10000);
+    FragInfo after = frag_info();
+    printf("defrag: frag %.2f -> %.2f, rss %zuK -> %zuK (%lu passes, %lu futile, %lu blocks moved in total)\n",
+           before.ratio, after.ratio, before.rss >> 10, after.rss >> 10,
+           __atomic_load_n(&defrag_passes, __ATOMIC_RELAXED),
+           __atomic_load_n(&defrag_futile, __ATOMIC_RELAXED),
+           __atomic_load_n(&defrag_moved, __ATOMIC_RELAXED));
+    compress_min = cmin;
+    kv_flush(&gkv);
+}
+
+#ifdef KV_LZ4
+/* JSON-ish documents that share their field names: size and ratio of the stored
+   form, and what packing/unpacking costs. */
+#define BENCH_DOCS 2000
+
+static void bench_compress(void){
+    char key[KEYLEN], doc[8192];
+    unsigned seed = 7;
+    memset(&lz4_stats, 0, sizeof(lz4_stats));
+    for(int i=0;i<BENCH_DOCS;i++){
+        size_t len = snprintf(doc, sizeof(doc), "{\"id\":%d,\"items\":[", i);
+        for(int j=0;j<40;j++)
+            len += snprintf(doc + len, sizeof(doc) - len,
+                            "%s{\"sku\":\"SKU-%05u\",\"qty\":%u,\"price\":%u.%02u,\"status\":\"%s\"}",
+                            j ? "," : "", rand_r(&seed) % 100000, rand_r(&seed) % 10,
+                            rand_r(&seed) % 500, rand_r(&seed) % 100,
+                            rand_r(&seed) % 4 ? "shipped" : "backordered");
+        snprintf(doc + len, sizeof(doc) - len, "]}");
+        snprintf(key, sizeof(key), "doc%d", i);
+        kv_write(&gkv, key, doc);
+    }
+    for(int i=0;i<BENCH_DOCS;i++){
+        snprintf(key, sizeof(key), "doc%d", i);
+        char *v = kv_read(&gkv, key);
+        if(v == NULL || strncmp(v, "{\"id\":", 6) != 0) printf("doc%d: bad read back\n", i);
+        free(v);
+    }
+    kv_compress_stats();
+    kv_flush(&gkv);
+}
+#endif
+
 /* ---------- main ---------- */
-int main(void){
+int main(int argc, char **argv){
+    static const struct option opts[] = {
+        { "compress-min", required_argument, NULL, 'c' },
+        { "dict",         required_argument, NULL, 'd' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while((opt = getopt_long(argc, argv, "", opts, NULL)) != -1){
+        switch(opt){
+        case 'c': compress_min = strtoul(optarg, NULL, 10); break;
+        case 'd': if(lz4_load_dict(optarg) < 0) return 1; break;
+        default:
+            fprintf(stderr, "usage: %s [--compress-min=BYTES] [--dict=FILE] [bench]\n", argv[0]);
+            return 1;
+        }
+    }
+
     kv_init(&gkv);
     locks_init();
     for(int i=0;i<MAX_TXNS;i++) for(int j=0;j<MAX_TXNS;j++) wait_for[i][j]=false;
     for(int i=0;i<MAX_TXNS;i++) txns[i] = NULL;
 
+    if(optind < argc && strcmp(argv[optind], "bench") == 0){
+        printf("%d threads, %d hot keys, %d keys per txn\n",
+               BENCH_THREADS, BENCH_HOT_KEYS, BENCH_KEYS_PER_TXN);
+        bench_run(BENCH_2PL);
+        bench_run(BENCH_DET);
+        bench_run(BENCH_ADD);
+        zipf_init();
+        printf("%d keys, zipf s=1\n", BENCH_ZIPF_KEYS);
+        bench_run(BENCH_ZIPF);
+        bench_bigfree(false);
+        bench_bigfree(true);
+        bench_defrag();
+#ifdef KV_LZ4
+        bench_compress();
+#endif
+        return 0;
+    }
+
     // seed keys
     kv_write(&gkv, "x", "1");
     kv_write(&gkv, "y", "2");
@@ -469,6 +2170,46 @@ int main(void){
     printf("Final: x=%s y=%s\n", vx?vx:"(null)", vy?vy:"(null)");
     free(vx); free(vy);
 
+    // same conflicting access pattern, but with declared key sets
+    MoveArgs m1 = { "x", "y" }, m2 = { "y", "x" };
+    pthread_create(&t1, NULL, oneshot_fn, &m1);
+    pthread_create(&t2, NULL, oneshot_fn, &m2);
+    pthread_join(t1, NULL);
+    pthread_join(t2, NULL);
+
+    vx = kv_read(&gkv, "x");
+    vy = kv_read(&gkv, "y");
+    printf("Final: x=%s y=%s\n", vx?vx:"(null)", vy?vy:"(null)");
+    free(vx); free(vy);
+
+    // plain 2PL txns with the same pattern: the victim retries and both commit
+    kv_write(&gkv, "x", "1");
+    kv_write(&gkv, "y", "2");
+    pthread_create(&t1, NULL, retry_fn, &m1);
+    pthread_create(&t2, NULL, retry_fn, &m2);
+    pthread_join(t1, NULL);
+    pthread_join(t2, NULL);
+
+    vx = kv_read(&gkv, "x");
+    vy = kv_read(&gkv, "y");
+    printf("Final: x=%s y=%s\n", vx?vx:"(null)", vy?vy:"(null)");
+    free(vx); free(vy);
+
+    txn_run_ro(print_xy_body, NULL);
+
+    // a waiter with a 50ms lock timeout gives up instead of queueing behind a slow txn
+    pthread_create(&t1, NULL, slow_holder_fn, NULL);
+    usleep(50000);
+    txn_set_default_timeouts(50, 0);
+    Transaction *tw = txn_begin();
+    txn_set_default_timeouts(0, 0);
+    char *v;
+    int rc = txn_get(tw, "x", &v);
+    if(rc == TXN_TIMEOUT) printf("lock wait on x timed out\n");
+    else if(rc == 0) free(v);
+    txn_abort(tw);
+    pthread_join(t1, NULL);
+
     return 0;
 }
 